@@ -0,0 +1,90 @@
+/*
+ *  capture.c
+ *  Davis
+ *
+ *  Serial capture files.  See capture.h.  Written through stdio, so a
+ *  capture costs a memcpy per read and a write() per few kilobytes.
+ *
+ * $Revision$
+ */
+
+#include <stdio.h>		// for FILE
+#include <string.h>		// for memcmp
+
+#include "capture.h"
+#include "trace.h"		// for usNow
+
+/***************/
+/* CAPTUREOPEN */
+/***************/
+int captureOpen(struct capture * c, const char * name) {
+	if ((c->fp = fopen(name, "w")) == NULL)
+		return -1;
+	c->last = usNow();
+	c->records = c->bytes = 0;
+	if (fwrite(CAPMAGIC, 8, 1, c->fp) != 1) {
+		fclose(c->fp);
+		return -1;
+	}
+	return 0;
+}
+
+/****************/
+/* CAPTUREWRITE */
+/****************/
+int captureWrite(struct capture * c, int station, const unsigned char * p, int len) {
+	unsigned char hdr[CAPHDRSIZE];
+	long long now = usNow();
+	unsigned int delta = (now - c->last > 0xFFFFFFFFLL) ? 0xFFFFFFFF : now - c->last;
+	c->last = now;
+	hdr[0] = delta; hdr[1] = delta >> 8; hdr[2] = delta >> 16; hdr[3] = delta >> 24;
+	hdr[4] = station; hdr[5] = station >> 8;
+	hdr[6] = len; hdr[7] = len >> 8;
+	if (fwrite(hdr, CAPHDRSIZE, 1, c->fp) != 1 || fwrite(p, len, 1, c->fp) != 1)
+		return -1;
+	c->records++;
+	c->bytes += len;
+	return 0;
+}
+
+/*****************/
+/* CAPTUREREPLAY */
+/*****************/
+int captureReplay(struct capture * c, const char * name) {
+	char magic[8];
+	if ((c->fp = fopen(name, "r")) == NULL)
+		return -1;
+	if (fread(magic, 8, 1, c->fp) != 1 || memcmp(magic, CAPMAGIC, 8)) {
+		fclose(c->fp);
+		return -1;
+	}
+	c->records = c->bytes = 0;
+	return 0;
+}
+
+/***************/
+/* CAPTURENEXT */
+/***************/
+int captureNext(struct capture * c, unsigned int * delta, int * station, unsigned char * buf) {
+	// buf must hold CAPMAXREAD bytes
+	unsigned char hdr[CAPHDRSIZE];
+	int len;
+	if (fread(hdr, CAPHDRSIZE, 1, c->fp) != 1)
+		return 0;
+	*delta = hdr[0] | (hdr[1] << 8) | (hdr[2] << 16) | ((unsigned int)hdr[3] << 24);
+	*station = hdr[4] | (hdr[5] << 8);
+	len = hdr[6] | (hdr[7] << 8);
+	if (len == 0 || len > CAPMAXREAD || fread(buf, len, 1, c->fp) != 1)
+		return -1;
+	c->records++;
+	c->bytes += len;
+	return len;
+}
+
+/****************/
+/* CAPTURECLOSE */
+/****************/
+void captureClose(struct capture * c) {
+	fclose(c->fp);
+	c->fp = NULL;
+}
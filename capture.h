@@ -0,0 +1,33 @@
+/*
+ *  capture.h
+ *  Davis
+ *
+ *  Capture file of the raw bytes read from the consoles, so a noisy site
+ *  can be replayed through the framer and decoder later.  After the magic,
+ *  each read is a record header followed by the bytes:
+ *
+ *    4 bytes  uSec since the previous record (saturates)
+ *    2 bytes  controller number
+ *    2 bytes  length
+ *
+ *  All little endian.
+ *
+ * $Revision$
+ */
+
+#define CAPMAGIC "DAVISCP1"
+#define CAPHDRSIZE 8		/* per record */
+#define CAPMAXREAD 8192		/* longest record: a whole framer ring */
+
+struct capture {
+	FILE * fp;
+	long long last;			// uSec of the previous record
+	unsigned int records;
+	unsigned int bytes;
+};
+
+int captureOpen(struct capture * c, const char * name);	// start a new capture. 0 = ok
+int captureWrite(struct capture * c, int station, const unsigned char * p, int len);	// 0 = ok
+int captureReplay(struct capture * c, const char * name);	// open to read. 0 = ok
+int captureNext(struct capture * c, unsigned int * delta, int * station, unsigned char * buf);	// length, 0 at end, -1 if damaged
+void captureClose(struct capture * c);
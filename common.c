@@ -26,6 +26,11 @@
 #include <unistd.h>		// for write 
 #include <assert.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>		// for writev
+#include <poll.h>		// for poll
+#ifdef __linux__
+#include <linux/serial.h>	// for ASYNC_LOW_LATENCY
+#endif
 
 #include "common.h"
 #include "../Common/sbus.h"		// For the TS7550 stuff
@@ -49,6 +54,39 @@ extern
 int errno;
 
 char buffer[206];	// General messages
+void (*logHook)(int severity, const char * msg) = NULL;	// if set, logmsg passes events to it
+
+// Asynchronous logging: logmsg only copies the message into a ring, and
+// logDrain writes batches of them from whichever thread the program chooses.
+// Any thread may log, so a slot is claimed with compare and swap and marked
+// ready once filled; there is only ever one drainer.
+struct logslot {
+	volatile int ready;
+	int severity;
+	time_t t;
+	char msg[176];
+};
+struct logslot * logRing = NULL;	// NULL until logAsync
+unsigned int logSlots;
+volatile unsigned int logHead, logTail;
+volatile unsigned int logLost;		// messages dropped because the ring was full
+volatile int logDraining;			// 1 while a thread is in logDrain
+int logWakeFd = -1;
+
+// Log storm suppression.  Once logLimit has given a severity a budget, each
+// distinct message of that severity is written at most that many times in
+// LOGWINDOW seconds.  The rest are counted, and when the window ends one
+// "repeated N times" line stands for them.
+struct logkey {
+	unsigned int hash;		// of the text; 0 if the entry is free
+	int severity;
+	time_t start;			// of the current window
+	int count;				// written and suppressed in this window
+	char msg[176];
+};
+struct logkey logKeys[LOGKEYS];
+int logBudget[FATAL];		// per message per LOGWINDOW, 0 for no limit. FATAL never is
+volatile int logKeyLock;
 
 enum Platform platform = undefPlatform;
 #define TS7500REDLEDMASK 0x4000
@@ -69,6 +107,15 @@ int getMcpVersion(int fd);
 /* LOGMSG */
 /**********/
 void logmsg(int severity, char *msg) {
+	// Write msg unless it is over its budget, see logLimit
+	if (severity < FATAL && logBudget[severity] && logLimited(severity, msg)) return;
+	logWrite(severity, msg);
+}
+
+/************/
+/* LOGWRITE */
+/************/
+void logWrite(int severity, char *msg) {
 	// Write error message to logfile and socket if possible and abort program for FATAL
 	// Truncate total message including timestamp and 'event ' to 206 bytes.
 	
@@ -79,6 +126,10 @@ void logmsg(int severity, char *msg) {
 	
 	char buffer[206];	// This MUST be local!
 	time_t now;
+	if (logRing) {
+		logQueue(severity, msg);
+		return;
+	}
 	if (strlen(msg) > 174) msg[174] = '\0';
 	now = time(NULL);
 	strcpy(buffer, ctime(&now));
@@ -95,7 +146,10 @@ void logmsg(int severity, char *msg) {
 		strcpy(buffer, "event ");
 		strcat(buffer, msg);
 		DEBUG2 fprintf(stderr, "Socket ");
-		sockSend(sockfd[0], buffer);
+		if (logHook)
+			logHook(severity, buffer);	// eg to be sent by another thread
+		else
+			sockSend(sockfd[0], buffer);
 	}
 	DEBUG2 fputs(buffer, stderr);
 	if (severity > ERROR) {              // If severity is FATAL terminate program
@@ -105,6 +159,204 @@ void logmsg(int severity, char *msg) {
 	}
 }
 
+/************/
+/* LOGLIMIT */
+/************/
+void logLimit(int severity, int budget) {
+	// Allow budget of each message of this severity per LOGWINDOW. 0 for no limit
+	if (severity >= INFO && severity < FATAL) logBudget[severity] = budget;
+}
+
+/*************/
+/* LOGREPEAT */
+/*************/
+int logRepeat(struct logkey * k, char * summary) {
+	// If k has had messages suppressed, put a line for them in summary and return 1.
+	// Call with logKeyLock held.
+	int repeats = k->count - logBudget[k->severity];
+	if (k->hash == 0 || repeats <= 0) return 0;
+	snprintf(summary, 175, "%.140s (repeated %d times)", k->msg, repeats);
+	return 1;
+}
+
+/**************/
+/* LOGLIMITED */
+/**************/
+int logLimited(int severity, const char * msg) {
+	// Count msg against its budget. Returns 1 if it should not be written.
+	struct logkey * k, * oldest = logKeys;
+	const unsigned char * p;
+	unsigned int hash = 2166136261u;	// FNV-1a
+	char summary[176];
+	int previous = 0, previousSeverity = severity, over;
+	time_t now = time(NULL);
+	for (p = (const unsigned char *)msg; *p && p < (const unsigned char *)msg + 174; p++)
+		hash = (hash ^ *p) * 16777619u;
+	if (hash == 0) hash = 1;
+	while (__sync_lock_test_and_set(&logKeyLock, 1));	// either thread may log
+	for (k = logKeys; k < logKeys + LOGKEYS; k++) {
+		if (k->hash == hash && k->severity == severity && strncmp(k->msg, msg, 174) == 0) break;
+		if (k->start < oldest->start) oldest = k;		// a free entry has start 0
+	}
+	if (k == logKeys + LOGKEYS) {		// new message: take a free entry or the oldest
+		k = oldest;
+		previous = logRepeat(k, summary);
+		previousSeverity = k->severity;
+		k->hash = hash;
+		k->severity = severity;
+		strncpy(k->msg, msg, 174);
+		k->msg[174] = '\0';
+		k->count = 0;
+		k->start = now;
+	} else if (now - k->start >= LOGWINDOW) {
+		previous = logRepeat(k, summary);
+		k->count = 0;
+		k->start = now;
+	}
+	over = ++k->count > logBudget[severity];
+	__sync_lock_release(&logKeyLock);
+	if (previous) logWrite(previousSeverity, summary);
+	return over;
+}
+
+/**************/
+/* LOGREPEATS */
+/**************/
+void logRepeats(void) {
+	// Write the summary of each message whose window has ended with some
+	// suppressed, and forget it.  Call every few seconds.
+	struct logkey * k;
+	char summary[176];
+	int severity, found;
+	time_t now = time(NULL);
+	do {
+		found = 0;
+		while (__sync_lock_test_and_set(&logKeyLock, 1));
+		for (k = logKeys; k < logKeys + LOGKEYS; k++)
+			if (k->hash && now - k->start >= LOGWINDOW) {
+				found = logRepeat(k, summary);
+				severity = k->severity;
+				k->hash = 0;
+				k->start = 0;
+				if (found) break;
+			}
+		__sync_lock_release(&logKeyLock);
+		if (found) logWrite(severity, summary);
+	} while (found);
+}
+
+/************/
+/* LOGASYNC */
+/************/
+int logAsync(int slots, int wakefd) {
+	// From now on logmsg queues messages for logDrain.  A byte is written to
+	// wakefd, if not -1, whenever the ring has been empty.  Returns 0 if ok.
+	// With slots 0, write what is queued and go back to logging directly.
+	struct logslot * ring = logRing;
+	if (slots == 0) {
+		logDrain();
+		logRing = NULL;
+		free(ring);
+		return 0;
+	}
+	if ((ring = calloc(slots, sizeof(struct logslot))) == NULL)
+		return -1;
+	logSlots = slots;
+	logHead = logTail = logLost = 0;
+	logWakeFd = wakefd;
+	logRing = ring;
+	return 0;
+}
+
+/************/
+/* LOGQUEUE */
+/************/
+void logQueue(int severity, const char * msg) {
+	// Copy msg to a free slot.  A FATAL then waits up to LOGFATALWAIT mSec 
+	// for it to be written - draining the ring itself if no other thread is - 
+	// and writes it straight to the file if even that doesn't happen in time.
+	struct logslot * s;
+	unsigned int head;
+	int waited, queued = 0;
+	do {
+		head = logHead;
+		if (head - logTail >= logSlots) {
+			logLost++;
+			break;
+		}
+	} while (!(queued = __sync_bool_compare_and_swap(&logHead, head, head + 1)));
+	if (queued) {
+		s = &logRing[head % logSlots];
+		s->severity = severity;
+		s->t = time(NULL);
+		strncpy(s->msg, msg, 174);
+		s->msg[174] = '\0';
+		__sync_synchronize();	// contents before ready
+		s->ready = 1;
+		if (logWakeFd >= 0 && head == logTail) write(logWakeFd, "", 1);
+	}
+	if (severity < FATAL) return;
+	for (waited = 0; waited < LOGFATALWAIT && logTail != logHead; waited += 10)
+		if (logDrain() == 0) usleep(10000);		// someone else is draining
+	if (logfp && (!queued || logTail != logHead)) {
+		fprintf(logfp, "%s%s\n", msg, queued ? " (log flush timed out)" : "");
+		fflush(logfp);
+	}
+	if (logfp) fclose(logfp);
+	exit(severity);
+}
+
+/************/
+/* LOGDRAIN */
+/************/
+int logDrain(void) {
+	// Write everything queued: WARN and worse to the log file with one flush,
+	// and every message to the server as logmsg would have.  Returns the number
+	// written, 0 if there was nothing or another thread is already draining.
+	struct logslot * s;
+	char line[220];
+	char stamp[26];
+	time_t last = 0;
+	unsigned int lost;
+	int n = 0;
+	if (!logRing || __sync_lock_test_and_set(&logDraining, 1)) return 0;
+	while ((s = &logRing[logTail % logSlots])->ready) {
+		__sync_synchronize();	// ready before contents
+		if (s->t != last) {		// ctime once per second of messages
+			last = s->t;
+			strcpy(stamp, ctime(&last));
+			stamp[24] = ' ';
+		}
+		if (logfp && s->severity > INFO) {
+			fputs(stamp, logfp);
+			fputs(s->msg, logfp);
+			fputc('\n', logfp);
+		}
+		DEBUG2 fprintf(stderr, "LOGMSG %s%s\n", stamp, s->msg);
+		if (sockfd[0] > 0) {
+			snprintf(line, sizeof(line), "event %s", s->msg);
+			if (logHook)
+				logHook(s->severity, line);
+			else
+				sockSend(sockfd[0], line);
+		}
+		s->ready = 0;
+		__sync_synchronize();	// finished with the slot before releasing it
+		logTail++;
+		n++;
+	}
+	if ((lost = logLost)) {
+		__sync_fetch_and_sub(&logLost, lost);
+		last = time(NULL);
+		strcpy(stamp, ctime(&last));
+		stamp[24] = ' ';
+		if (logfp) fprintf(logfp, "%sWARN %s %u log messages lost\n", stamp, progname, lost);
+	}
+	if ((n || lost) && logfp) fflush(logfp);
+	__sync_lock_release(&logDraining);
+	return n;
+}
+
 /**************/
 /* GETVERSION */
 /**************/
@@ -292,6 +544,41 @@ int openSerialDevice(const char * name, int baud, int parity, int databits, int
 	return fd;
 }
 
+/******************/
+/* SETSERIALFRAME */
+/******************/
+int setSerialFrame(int fd, int vmin, int gap) {
+	// Packet mode for a device opened by openSerialDevice: a read() returns once 
+	// vmin bytes have arrived, or the line has been quiet for gap mSec after the 
+	// first byte.  So a whole frame costs one wakeup instead of one per byte.
+	// vmin = 0 goes back to polled reads.  Returns tcsetattr result (-1 if not a tty).
+	struct termios settings;
+	if (tcgetattr(fd, &settings) < 0)
+		return -1;
+	if (vmin > 255) vmin = 255;		// c_cc is a byte
+	settings.c_cc[VMIN] = vmin;
+	settings.c_cc[VTIME] = vmin ? (gap + 99) / 100 : 0;	// tenths of a second
+	return tcsetattr(fd, TCSANOW, &settings);
+}
+
+/*****************/
+/* SETLOWLATENCY */
+/*****************/
+int setLowLatency(int fd) {
+	// Ask the UART driver to push received bytes to the tty layer at once
+	// rather than on its next timer tick.  Not all drivers support it.
+#if defined(TIOCSSERIAL) && defined(ASYNC_LOW_LATENCY)
+	struct serial_struct ss;
+	if (ioctl(fd, TIOCGSERIAL, &ss) < 0)
+		return -1;
+	ss.flags |= ASYNC_LOW_LATENCY;
+	return ioctl(fd, TIOCSSERIAL, &ss);
+#else
+	errno = ENOTTY;
+	return -1;
+#endif
+}
+
 /********************/
 /* OPENSERIALSOCKET */
 /********************/
@@ -425,33 +712,55 @@ int reopenSerial(const int fd, const char * name, int baud, int parity, int data
 /************/
 void sockSend(const int fd, const char * msg) {
 	// Send the string to the server.  May terminate the program if necessary
-	short int msglen, written;
-	int retries = numretries;
+	// Length and string go in one writev.  If the socket is non-blocking and
+	// full, wait for it up to numretries times retrydelay.
+	unsigned short msglen;
+	struct iovec iov[2], * v = iov;
+	struct pollfd p;
+	int iovs = 2, retries = numretries;
+	ssize_t written;
 	
 	if (noserver) {
 		puts(msg);
 		return;
 	}
 	
-	msglen = strlen(msg);
-	written = htons(msglen);
-	if (write(fd, &written, 2) != 2) { // Can't even send length ??
-		sockfd[0] = 0;             // prevent logmsg trying to write to socket!
-		sprintf(buffer, "ERROR %s Can't write a length to socket", progname);
-		logmsg(ERROR, buffer);
-	}
-	while ((written = write(fd, msg, msglen)) < msglen) {
+	msglen = htons(strlen(msg));
+	iov[0].iov_base = &msglen;
+	iov[0].iov_len = 2;
+	iov[1].iov_base = (void *)msg;
+	iov[1].iov_len = strlen(msg);
+	while (iovs) {
+		if ((written = writev(fd, v, iovs)) < 0) {
+			if (errno == EINTR) continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				char buffer[50];	// not the global one: this may be the publisher thread
+				sockfd[0] = 0;             // prevent logmsg trying to write to socket!
+				sprintf(buffer, "ERROR %s Can't write to socket", progname);
+				logmsg(ERROR, buffer);
+				return;
+			}
+			written = 0;
+		}
+		while (iovs && written >= (ssize_t)v->iov_len) {
+			written -= v->iov_len;
+			v++;
+			iovs--;
+		}
+		if (iovs == 0) break;
 		// not all written at first go
-		msg += written; 
-		msglen -= written;
-		DEBUG printf("Socksend: Only wrote %d; %d left \n", written, msglen);
+		v->iov_base = (char *)v->iov_base + written;
+		v->iov_len -= written;
+		DEBUG printf("Socksend: %d left of this part\n", (int)v->iov_len);
 		if (--retries == 0) {
 			char buffer[50];
 			sprintf(buffer, "WARN %s %d Timed out writing to server", progname, controllernum);
 			logmsg(WARN, buffer);
 			return;
 		}
-		usleep(retrydelay);
+		p.fd = fd;
+		p.events = POLLOUT;
+		poll(&p, 1, retrydelay / 1000);
 	}
 }
 
@@ -513,6 +822,44 @@ int openSockets(int start, int servers, char * logon, char * revision, char * ex
 	return newstyle;
 }
 
+/*******************/
+/* RECONNECTSOCKET */
+/*******************/
+int reconnectSocket(char * logon, char * revision, char * extra) {
+	// Like openSockets for a single old-style connection, but failure is not fatal
+	// so the caller can keep collecting data and try again later.
+	// Returns 0 with sockfd[0] set if connected.  May be called from a thread 
+	// other than main, so it has its own buffer.
+	struct sockaddr_in serv_addr;
+	struct hostent *server;
+	char buffer[206];
+	int fd;
+	
+	if (noserver) return 0;
+	if ((server = gethostbyname(HOSTNAME)) == NULL)
+		return -1;
+	bzero((char *) &serv_addr, sizeof(serv_addr));
+	serv_addr.sin_family = AF_INET;
+	bcopy((char *)server->h_addr,
+		  (char *)&serv_addr.sin_addr.s_addr,
+		  server->h_length);
+	serv_addr.sin_port = htons(PORTNO);
+	if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+		return -1;
+	if (connect(fd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0) {
+		close(fd);
+		return -1;
+	}
+	sockfd[0] = fd;
+	sprintf(buffer, "logon %s %s %d %d %s", logon, getVersion(revision), getpid(), controllernum, extra);
+	sockSend(fd, buffer);
+	if (sockfd[0] != fd) {		// the logon failed and sockSend gave up the socket
+		close(fd);
+		return -1;
+	}
+	return 0;
+}
+
 /**************/
 /* GETVERSION */
 /**************/
@@ -31,16 +31,30 @@ enum Platform {undefPlatform = 0, ts72x0, ts75x0, sheeva, guru, x86};
 #define REDLED 1
 #define GREENLED 2
 #define CONNECTRETRY 10		/* Interval to retry if device not found (USB disconnect) */
+#define LOGFATALWAIT 2000	/* mSec a FATAL waits for queued log messages to be written */
+#define LOGWINDOW 60		/* seconds over which logLimit budgets apply */
+#define LOGKEYS 32		/* distinct messages logLimit keeps count of */
 
 void logmsg(int severity, char *msg);   // Log a message to server and file
+extern void (*logHook)(int severity, const char * msg);	// replaces sockSend for logmsg events
+void logWrite(int severity, char *msg);	// logmsg without the budget check
+void logLimit(int severity, int budget);	// at most budget of each message per LOGWINDOW
+int logLimited(int severity, const char * msg);	// 1 if msg is over budget
+void logRepeats(void);	// write "repeated N times" for windows that have ended
+int logAsync(int slots, int wakefd);	// queue logmsg messages for logDrain. 0 = ok
+void logQueue(int severity, const char * msg);	// logmsg once logAsync has been called
+int logDrain(void);		// write queued messages to file and server. Returns number written
 char * getVersion(const char * revision);			// Convert $REVISION$ macro
 void decode(char * msg);
 time_t timeMod(time_t t, int jitter);
 int openSerial(const char * name, int baud, int parity, int databits, int stopbits);  // return fd
 int reopenSerial(const int fd, const char * name, int baud, int parity, int databits, int stopbits);  // return fd
 void closeSerial(int fd);  // restore terminal settings
+int setSerialFrame(int fd, int vmin, int gap);	// read() returns vmin bytes or after gap mSec quiet
+int setLowLatency(int fd);	// low latency UART handling where the driver has it
 void sockSend(const int fd, const char * msg);        // send a string
 int openSockets(int start, int servers, char * logon, char * revision, char * extra, int newstyle); // Open server socket
+int reconnectSocket(char * logon, char * revision, char * extra);	// Retry server after a failure. 0 = ok
 void blinkLED(int state, int which);
 void determinePlatform(void);	// Establish platform
 void disable_rts(int fd); 	// for ISO-485 board
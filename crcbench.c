@@ -0,0 +1,80 @@
+/*
+ *  crcbench.c
+ *  Davis
+ *
+ *  Micro-benchmark: the original byte-wise CRC loop from checkCRC() against
+ *  crcUpdate(), whole-buffer and fed in serial-sized chunks, over LOOP (99),
+ *  HILOWS (438) and GETEE (4098) sized buffers.
+ *
+ *  Usage: crcbench [iterations]
+ *
+ * $Revision$
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "ccitt.h"
+
+#define CHUNK 32	/* typical bytes per read() at 19200 baud */
+
+static unsigned char buf[4098];
+static volatile unsigned short sink;	// stop the compiler discarding the work
+
+/* The loop checkCRC() used before crcUpdate() */
+static unsigned short bytewise(int size, const unsigned char * msg) {
+	int i;
+	int crc = 0;
+	for (i = 0; i < size; i++)
+		crc = (crc_table[(crc >> 8) ^ *msg++] ^ (crc << 8)) & 0xFFFF;
+	return crc;
+}
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+	int sizes[] = {99, 438, 4098};
+	long iterations = 200000;
+	long it;
+	int i, s, n;
+	double t0, t1, t2, t3;
+	unsigned short crc;
+	
+	if (argc > 1) iterations = atol(argv[1]);
+	srand(1);
+	for (i = 0; i < sizeof(buf); i++) buf[i] = rand();
+	crcInit();
+	
+	printf("%6s %12s %12s %12s %8s\n", "size", "bytewise", "slice4", "chunked", "speedup");
+	for (s = 0; s < 3; s++) {
+		long loops = iterations * 99 / sizes[s];	// same number of bytes for each size
+		if (bytewise(sizes[s], buf) != crcUpdate(0, buf, sizes[s])) {
+			printf("MISMATCH at size %d\n", sizes[s]);
+			return 1;
+		}
+		t0 = now();
+		for (it = 0; it < loops; it++) sink = bytewise(sizes[s], buf);
+		t1 = now();
+		for (it = 0; it < loops; it++) sink = crcUpdate(0, buf, sizes[s]);
+		t2 = now();
+		for (it = 0; it < loops; it++) {	// as the framer does it
+			crc = 0;
+			for (i = 0; i < sizes[s]; i += n) {
+				n = sizes[s] - i < CHUNK ? sizes[s] - i : CHUNK;
+				crc = crcUpdate(crc, buf + i, n);
+			}
+			sink = crc;
+		}
+		t3 = now();
+		// nanoseconds per byte
+		printf("%6d %9.2f ns %9.2f ns %9.2f ns %7.2fx\n", sizes[s], 
+			(t1 - t0) * 1e9 / (loops * sizes[s]), (t2 - t1) * 1e9 / (loops * sizes[s]),
+			(t3 - t2) * 1e9 / (loops * sizes[s]), (t1 - t0) / (t2 - t1));
+	}
+	return 0;
+}
@@ -3,6 +3,7 @@
 #include <stdio.h>	// for FILE
 #include <stdlib.h>	// for timeval
 #include <string.h>	// for strlen etc
+#include <ctype.h>	// for isdigit
 #include <time.h>	// for ctime
 #include <sys/types.h>	// for fd_set
 // #include <sys/socket.h>
@@ -11,15 +12,30 @@
 #include <fcntl.h>	// for O_RDWR
 #include <termios.h>	// for termios
 #include <unistd.h>		// for getopt
+#include <signal.h>		// for SIGPIPE
+#include <poll.h>		// for poll
+#include <pthread.h>	// for pthread_create
 #ifdef linux
 #include <errno.h>		// for Linux
 #include <sys/uio.h>	// for struct iovec
 #endif
 #include "ccitt.h"		// for CRC
+#include "framer.h"		// for struct framer
+#include "vantage.h"	// for struct hilows
+#include "rolling.h"	// for struct rolling
+#include "store.h"		// for struct store
+#include "queue.h"		// for struct queue
+#include "spsc.h"		// for struct spsc
+#include "sched.h"		// for struct task
+#include "metrics.h"	// for struct metrics
+#include "trace.h"		// for struct trace
+#include "capture.h"	// for struct capture
+#include "outbuf.h"		// for struct outbuf
+#include "sendq.h"		// for struct sendq
 
 #include "../Common/common.h"
 
-#define REVISION "$Revision: 1.7 $"
+#define REVISION "$Revision: 1.23 $"
 /* 1.0 Initial version created from Steca
 	1.1 2008/06/12 Close and re-open serial port if connection is lost
 	1.2 2009/04/13 Ability to grab a snapshot using LOOP command option.
@@ -28,6 +44,22 @@
     1.5 2010/04/21 When debug=1, data message shown. Also set interval (timeout) by command
     1.6 2010/08/15 Common Serial Framework plus message suppression
 	1.7 2011/10/16 More tolerance of noise - use getbuf()
+	1.8 2026/10/16 Streaming mode (-S) - continuous LOOP n instead of LOOP 1 per interval
+	1.9 2026/10/16 Ring buffer framer with CRC resynchronisation replaces getbuf()
+	1.10 2026/10/16 Archive download with DMPAFT, resumable via ARCHIVEFILE
+	1.11 2026/10/16 Single poll() event loop - console commands are resumable jobs, no blocking waits
+	1.12 2026/10/16 Publisher thread fed by a lock-free ring does all writes to the server
+	1.13 2026/10/16 Multi-station: several consoles, one event loop and one server connection
+	1.14 2026/10/16 Realtime, hilow and graph scheduled on the monotonic clock with timerfd
+	1.15 2026/10/16 Reuse a wake session for commands close together; wakeup latency recorded
+	1.16 2026/10/16 -P packet reads: VMIN/VTIME sized to the frame awaited, low latency UART
+	1.17 2026/10/16 Metrics: error counters and latency histograms, stats command and STATSFILE
+	1.18 2026/10/16 Trace ring of per-cycle phase times, trace command
+	1.19 2026/10/16 -C capture of the raw serial stream for replay
+	1.20 2026/10/16 Asynchronous batched logging; FATAL flush bounded by LOGFATALWAIT
+	1.21 2026/10/16 -m message suppression: per-severity budgets, repeats summarised
+	1.22 2026/10/16 Publisher batches messages to the server, one writev per flush
+	1.23 2026/10/16 Non-blocking server socket with a send queue; -B policy when it stalls
 */
 
 static char* id="@(#)$Id: davis.c,v 1.7 2011/10/16 15:16:07 martin Exp $";
@@ -39,11 +71,43 @@ const char progname[]=PROGNAME;
 #define PORTNO 10010
 #define LOGFILE "/tmp/davis.log"
 #define DUMPFILE "/tmp/davis.dat"
+#define ARCHIVEFILE "/tmp/davis.arc"	/* date and time of last archive record sent */
+#define QUEUEFILE "/tmp/davis.queue"	/* messages waiting for the server */
+#define STATSFILE "/tmp/davis.stats"	/* counters and latency histograms */
 #define SERIALNAME "/dev/ttyAM1"	/* although it MUST be supplied on command line */
 
 #define REALTIMEINTERVAL 300
 #define HILOWINTERVAL    3600
 #define GRAPHINTERVAL    86400
+#define STATSINTERVAL    300
+#define LOGSLOTS 64			/* log messages queued for the publisher to write */
+#define HILOWFRESH 60		/* seconds a cached HILOWS is served without asking the console */
+#define LOOPPERIOD 2		/* seconds between packets when streaming - sizes rolling windows */
+#define STORERECORDS 43200	/* 24 hours of streamed LOOP packets in the -T store */
+#define HISTORYMAX 100		/* most records sent for one history command */
+// Store and forward to the MCP
+#define QUEUESLOTS 4096		/* over 2 hours of streamed realtime */
+#define QUEUEBURST 1		/* backlog messages sent behind each live one */
+#define REPLAYRATE 20		/* further messages per second while there is a backlog */
+#define RECONNECTINTERVAL 30	/* seconds between attempts to reach a lost server */
+#define PUBSLOTS 256		/* messages between the acquisition and publisher threads */
+#define SENDQHIGH 192		/* messages waiting for a stalled server before -B applies */
+#define STALLWARN 60		/* seconds between warnings that the server has stalled */
+
+// Streaming mode (-S)
+#define LOOPCOUNT 200		/* packets per LOOP command - one every 2 seconds */
+#define STREAMTIMEOUT 5		/* seconds without a LOOP packet before re-arming */
+#define STREAMMISSES 3		/* consecutive re-arms with no data before reopening port */
+
+// Serial transactions - each runs a step at a time from the main loop
+#define JOBS 8			/* transactions waiting for the console */
+#define WAKETRIES 2		/* wakeups sent before giving up */
+#define WAKETIME 1500	/* mSec for the console to answer a wakeup */
+#define AWAKETIME 90000	/* mSec the console is trusted to stay awake after it last sent anything */
+#define REOPENDELAY 10	/* seconds between closing and reopening the port */
+#define REOPENRETRY 150	/* seconds between failed attempts to reopen it */
+#define MAXSTATIONS 8	/* consoles served by one process */
+#define FRAMEGAP 100	/* -P: mSec of silence that ends a packet read */
 
 // Severity levels.  FATAL terminates program
 #define INFO	0
@@ -61,6 +125,14 @@ int retrydelay = RETRYDELAY;
 #define WAITTIME 2      /*seconds*/
 // Set to if(0) to disable debugging
 #define ACK 0x06
+#define NAK 0x21
+#define ESC 0x1B
+// Archive download
+#define PAGESIZE 267		/* sequence + 5 records + 4 unused + CRC */
+#define RECORDSIZE 52
+#define PAGERETRIES 3
+
+#define makeshort(lsb, msb)  ( lsb | (msb << 8))
 
 /* SOCKET CLIENT */
 
@@ -76,28 +148,68 @@ extern
 int errno;  
 
 // Procedures in this file
-int processSocket(void);			// process server message
+int processSocket(int fd);			// process server message
 void usage(void);					// standard usage message
 int getBuffer(char * serialbuf, int size);
-int getbuf(int max, int tmout);	// get a buffer full of message
-int wakeup(int commfd);				// wake up station. 1 = failure.
+int fillframer(void);				// bulk read from commfd into the framer
 char * getversion(void);
 int checkCRC(int size, char *msg);	// calc CRC over a buffer
-time_t timeMod(time_t t);
-void dumphex(int n, char * data);
-void writepacket(unsigned char * data);	// Textual output for debug
+void dumphex(int n, const unsigned char * data);
+void writepacket(int * values);		// Textual output for debug
+void processLoop(unsigned char * packet);	// decode and forward a validated LOOP packet
+int loopChanged(void);				// 1 if loopvalues have moved past a deadband
+void sendRolling(void);				// rolling means and extremes to server
+void sendHistory(time_t since, int max);	// records from the store to server
+int batchQueue(int max);			// add queued messages to the batch. Returns number added
+void lostServer(void);				// server write failed - queue until reconnected
+void serverTick(void);				// reconnect and replay
+void sendRealtime(unsigned char * packet);	// forward a LOOP packet to server
+void sendBinary(char * tag, unsigned char * data, int len);	// tagged binary message to server
+void sendText(char * msg);			// text message to server
+int stationTag(const char * msg, char * out);	// davis -> davis.N for this station. Returns length
+void * publishLoop(void * arg);		// publisher thread: everything written to the server
+void publishMessage(struct spscslot * s);	// add one message from the ring to the batch
+void publishFlush(void);			// write the batch and release what it held
+void serverOpened(void);			// make a new server connection non-blocking
+int serverHandoff(int server);		// sockets from the publisher. Returns the one to read
+int realtimeMessage(const unsigned char * msg, int len);	// 1 if a framed realtime packet
+int spillMessage(const unsigned char * msg, int len);	// 1 if it goes to the queue while stalled
+void logEvent(int severity, const char * msg);	// logmsg hook: events from either thread
+int processCommand(char * buffer);	// act on one server message. 0 = shutdown
+int jobAdd(int type, int flags, int next);	// queue a serial transaction. 0 = ok
+int jobWaiting(int type);			// 1 if a transaction of type is queued
+void jobStart(void);				// wake the console for the first queued job
+void jobSend(void);					// console is awake - send the command
+void jobStep(int result);			// frame arrived (1), bad (-1) or timed out (0)
+void jobDone(void);					// finish the running job and start the next
+int dmpStep(int result);			// next DMPAFT step. 1 = finished
+void expect(int type, int size, int tmout);	// frame for the next jobStep
+void serialInput(void);				// commfd is readable
+void serialTick(void);				// timeouts, scheduled polls and reopening
+int pollTimeout(void);		// mSec until something is due
+void sendByte(int c);				// single control byte to the console
+void eeRequest(int flags);			// refresh eeconfig (or the image) and report it
+void eeReport(int flags);			// eeconfig is current - report it
+void replyHilows(void);				// hilows is current - send it to server
+void stopLoop(void);				// abandon a running LOOP before another command
+void reopen(void);					// close the serial port; serialTick reopens it
+void stationWarn(char * msg);		// log a warning about the current station
+void serialOpened(void);			// the port has just been opened
+void frameMode(void);				// set the read size for what the job is waiting for
+int statsFormat(char * buf, int size);	// counters and latencies for the stats command
+void statsWrite(void);				// the same in full to statsName
 
 /* GLOBALS */
 FILE * logfp = NULL;
 int sockfd[1] = {0};
 int debug = 0;
 int noserver = 0;		// prevents socket connection when set to 1
-char * serialName = SERIALNAME;
+int streaming = 0;		// set by -S: continuous LOOP instead of LOOP 1 every interval
+int packetMode = 0;		// set by -P: one read per frame instead of per byte burst
 
 // Common Serial Framework
 #define BUFSIZE 4100	/* should be longer than max possible message from Davis */
-int controllernum = -1;	//	only used in logon message
-int commfd;
+int controllernum = -1;	//	only used in logon message - the first station's
 int tmout = REALTIMEINTERVAL;
 struct data {	// The serial buffer
 	int count;
@@ -105,6 +217,113 @@ struct data {	// The serial buffer
 //	int escape;		// Count the escapes in this message
 //	int sentlength;
 } data;
+int hilowFresh = HILOWFRESH;	// -H: cache lifetime in seconds
+// Deadband change detection (-D)
+int maxSilence = 0;		// seconds: send at least this often. 0 = send every packet
+int deadband[LF_NUM];	// smallest change worth sending, from loopfields
+// Rolling statistics
+#define ROLLFIELDS 4
+#define ROLLWINDOWS 3
+const int rollfield[ROLLFIELDS] = {LF_OUTTEMP, LF_BAR, LF_WINDSPEED, LF_RAINRATE};
+const int rollwindow[ROLLWINDOWS] = {60, 600, 3600};
+int rollPublish = 0;	// -R: send davis rolling with each realtime
+char * storeName = NULL;	// -T: local time series
+struct queue queue;		// -Q: messages for the server
+char * queueName = QUEUEFILE;	// NULL if the queue could not be opened
+unsigned char sockbuf[300];	// partial message from the server
+int sockhave = 0;		// bytes in sockbuf
+// Acquisition (main) thread and publisher thread.  Only the publisher
+// writes to the server; everything else reaches it through pub.
+struct spsc pub;
+enum pubtag { P_QUEUED, P_TEXT };	// store and forward, or send only if connected
+// Publisher only: the batch being built, and what it refers to in pub and queue
+struct outbuf out;
+int pubHeld;			// pub slots in the batch
+int queueHeld;			// queued messages in the batch, oldest first
+int queueIndex[OUTMESSAGES];	// their positions in the batch
+char requeue[OUTMESSAGES];	// 1 for live messages to queue if they can't be written
+struct sendq sendq;		// what a stalled server has not taken yet
+volatile int serverStalled = 0;	// the last write would have blocked, or sendq isn't empty. Read by logEvent
+int sendPolicy = SQ_SPILL;	// -B: what gives way when sendq reaches SENDQHIGH
+const char * policyNames[] = {"drop", "coalesce", "spill"};
+pthread_t publisher;
+volatile int publishing = 1;	// cleared to stop the publisher
+volatile int serverEOF = 0;		// socket the acquisition thread found closed by the server
+int handoff[2];			// publisher to acquisition thread: each new server socket, minus each to close
+struct trace trace;		// phase times of recent cycles, all stations
+char * captureName = NULL;	// -C: record everything read from the consoles
+struct capture capture;
+
+// Serial transactions.  A command to the console is a job: wake it, send
+// the command, then wait for each reply frame, without ever blocking.  
+// job[0] is running; the rest wait their turn.
+enum jobtype { J_LOOP, J_STREAM, J_HILOWS, J_EESIG, J_EECONFIG, J_GETEE, J_DMPAFT };
+enum jobstate { S_IDLE, S_WAKE, S_REPLY, S_STREAM };
+enum dmpstep { D_ACK, D_HEADER, D_PAGE };
+#define J_REPLY	1		/* send the result to the server */
+#define J_DUMP	2		/* write the result to DUMPFILE */
+#define J_LOG	4		/* log the result */
+struct job {
+	int type;			// J_xxx
+	int flags;			// J_REPLY etc
+};
+
+// Scheduled polls, each on its own interval
+enum tasks { T_REALTIME, T_HILOW, T_GRAPH, T_STATS, T_NUM };
+int jitter = 0;			// -j: seconds after each interval boundary
+int schedfd = -1;		// timerfd for the next task
+
+// Everything belonging to one console.  With several (multi-station mode)
+// each is published under its own controller number; st is the one
+// being dealt with.
+struct station {
+	char * serialName;
+	int controllernum;
+	int commfd;
+	int vmin;			// -P: VMIN the port is set to, -1 if it can't do packet reads
+	struct framer framer;	// Ring buffer in front of data
+	int online;			// used to prevent messages every minute in the event of disconnection
+	time_t reopenTime;	// when serialTick next tries to open a closed port
+	struct task task[T_NUM];	// scheduled polls
+	int loopsLeft;		// packets still expected from the last LOOP n
+	// Serial transactions
+	int state;			// S_xxx
+	long long deadline;	// msNow() when the current state times out
+	int tries;			// wakeups or page resends left
+	int expect, size;	// frame type and size awaited in S_REPLY
+	int misses;			// streaming: consecutive re-arms with no packet
+	// Wake sessions: the console stays awake for about two minutes after
+	// activity, so a job started within AWAKETIME of the last byte skips the wakeup
+	long long awakeUntil;	// msNow() until which no wakeup is needed
+	long long wakeStart;	// when the first wakeup of this job was sent
+	int woken;			// 0 if the job skipped the wakeup and nothing has come back yet
+	// Metrics
+	struct metrics metrics;	// wakeups are H_WAKE; skipped ones M_WAKESKIP
+	long long sentAt;	// when the command or ACK the frame answers was sent, 0 once timed
+	int gotFirst;		// the first byte after it has been timed
+	char statsName[64];	// STATSFILE for this station
+	unsigned int cycle;	// trace cycle of the running job, 0 if none
+	int njobs;
+	struct job job[JOBS];
+	int step;			// DMPAFT: D_xxx
+	int pages, page, first, sent, done;
+	unsigned int last;	// DMPAFT: date << 16 | time of the last record sent
+	char archiveName[64];	// ARCHIVEFILE for this station
+	// Caches
+	struct hilows hilows;	// HILOWS cache
+	time_t hilowsTime;	// when hilows was read. 0 = never
+	unsigned char eeimage[EESIZE];	// EEPROM cache, indexed by address
+	int eevalid;		// 0 = nothing cached, 1 = configuration block, 2 = whole image
+	struct eeconfig eeconfig;	// decoded from eeimage
+	int loopvalues[LF_NUM];	// latest LOOP packet, decoded once
+	int lastsent[LF_NUM];	// values in the last packet sent
+	time_t lastSentTime;
+	int suppressed;		// packets not sent since the last one that was
+	struct rolling rolls[ROLLFIELDS][ROLLWINDOWS];
+	struct store store;	// -T: local time series
+	int storeOpen;		// 1 if store is in use
+} stations[MAXSTATIONS], * st = stations;
+int nstations = 0;
 
 /********/
 /* MAIN */
@@ -118,29 +337,42 @@ int main(int argc, char *argv[])
 
     char buffer[256];
 	int run = 1;		// set to 0 to stop main loop
-	fd_set readfd; 
-	int numfds;
-	struct timeval timeout;
+	struct pollfd fds[MAXSTATIONS + 3];
+	int server = 0;			// server socket the acquisition thread reads
 	int logerror = 0;
-	int online = 1;		// used to prevent messages every minute in the event of disconnection
-	int option, num, length; 
-	time_t nextRealTime = 0;	// when to do next RealTime collection;
-	struct iovec iov[3];
-	int suppressMessages = 0;
+	int option, num; 
+	char * suppressMessages = NULL;	// -m budgets
 
 	// Command line arguments
 	
 	// optind = -1;
 	opterr = 0;
-	while ((option = getopt(argc, argv, "dt:i:slVm:Z")) != -1) {
+	while ((option = getopt(argc, argv, "dt:i:j:slSPVm:H:D:RT:Q:C:B:Z")) != -1) {
 		switch (option) {
 		case 's': noserver = 1; break;
 		case 'l': nolog = 1; break;
 		case '?': usage(); exit(1);
 		case 't': 
 		case 'i':tmout = atoi(optarg); break;
+		case 'j': jitter = atoi(optarg); break;
 		case 'd': debug = 1; break;
-		case 'm': suppressMessages = atoi(optarg); break;
+		case 'S': streaming = 1; break;
+		case 'P': packetMode = 1; break;
+		case 'H': hilowFresh = atoi(optarg); break;
+		case 'D': maxSilence = atoi(optarg); break;
+		case 'R': rollPublish = 1; break;
+		case 'T': storeName = optarg; break;
+		case 'Q': queueName = optarg; break;
+		case 'C': captureName = optarg; break;
+		case 'm': suppressMessages = optarg; break;
+		case 'B': 
+			for (sendPolicy = SQ_SPILL; sendPolicy >= 0; sendPolicy--)
+				if (strcasecmp(optarg, policyNames[sendPolicy]) == 0) break;
+			if (sendPolicy < 0) {
+				usage(); 
+				exit(1);
+			}
+			break;
 		case 'V': printf("Version %s %s\n", getversion(), id); exit(0);
 		case 'Z': decode("(b+#Gjv~z`mcx-@ndd`rxbwcl9Vox=,/\x10\x17\x0e\x11\x14\x15\x11\x0b\x1a" 
 				 "\x19\x1a\x13\x0cx@NEEZ\\F\\ER\\\x19YTLDWQ'a-1d()#!/#(-9' >q\"!;=?51-??r"); exit(0);
@@ -148,32 +380,107 @@ int main(int argc, char *argv[])
 	}
 	
 	DEBUG printf("Debug on. optind %d argc %d\n", optind, argc);
+	if (suppressMessages) {		// one budget for all, or info,warn,error
+		int info, warn, error;
+		switch (sscanf(suppressMessages, "%d,%d,%d", &info, &warn, &error)) {
+		case 1: warn = error = info; break;
+		case 3: break;
+		default: usage(); exit(1);
+		}
+		logLimit(INFO, info);
+		logLimit(WARN, warn);
+		logLimit(ERROR, error);
+	}
+	for (num = 0; num < LF_NUM; num++) deadband[num] = loopfields[num].deadband;
 	
-	if (optind < argc) serialName = argv[optind];		// get serial device name: parameter 1
-	optind++;
-	if (optind < argc) controllernum = atoi(argv[optind]);	// get optional controller number: parameter 2
+	// Parameters are pairs of serial device name and controller number, one per console
+	for (; optind < argc && nstations < MAXSTATIONS; optind += 2) {
+		st = &stations[nstations++];
+		st->serialName = argv[optind];
+		st->controllernum = (optind + 1 < argc) ? atoi(argv[optind + 1]) : -1;
+	}
+	if (optind < argc) {		// more consoles than MAXSTATIONS
+		usage();
+		exit(1);
+	}
+	if (nstations == 0) {
+		stations[0].serialName = SERIALNAME;
+		stations[0].controllernum = -1;
+		nstations = 1;
+	}
+	controllernum = stations[0].controllernum;
 	
 	if (!nolog) if ((logfp = fopen(LOGFILE, "a")) == NULL) logerror = errno;	
 	
 	// There is no point in logging the failure to open the logfile
 	// to the logfile, and the socket is not yet open.
 
-	sprintf(buffer, "STARTED %s on %s as %d timeout %d %s", argv[0], serialName, controllernum, tmout, nolog ? "nolog" : "");
-	logmsg(INFO, buffer);
+	for (st = stations; st < stations + nstations; st++) {
+		sprintf(buffer, "STARTED %s on %s as %d timeout %d %s%s", argv[0], st->serialName, st->controllernum, tmout, nolog ? "nolog " : "",
+			streaming ? "streaming" : "");
+		logmsg(INFO, buffer);
+	}
 	
 	openSockets(0, 1, LOGON,  REVISION, "", 0);
+	serverOpened();
 	
-	// Open serial port
-	if ((commfd = openSerial(serialName, BAUD, 0, CS8, 1)) < 0) {
-		sprintf(buffer, "ERROR " PROGNAME " %d Failed to open %s: %s", controllernum, serialName, strerror(errno));
+	signal(SIGPIPE, SIG_IGN);	// a lost server shows up as a write error instead
+	if (queueOpen(&queue, queueName, QUEUESLOTS)) {
+		sprintf(buffer, "ERROR " PROGNAME " %d Can't open queue %s: %s", controllernum, queueName, strerror(errno));
+		logmsg(ERROR, buffer);
+		queueName = NULL;
+	}
+	if (captureName && captureOpen(&capture, captureName)) {
+		sprintf(buffer, "ERROR " PROGNAME " %d Can't open capture %s: %s", controllernum, captureName, strerror(errno));
+		logmsg(ERROR, buffer);
+		captureName = NULL;
+	}
+	
+	for (st = stations; st < stations + nstations; st++) {
+		for (num = 0; num < ROLLFIELDS * ROLLWINDOWS; num++)
+			if (rollInit(&st->rolls[num / ROLLWINDOWS][num % ROLLWINDOWS], rollwindow[num % ROLLWINDOWS], 
+						 rollwindow[num % ROLLWINDOWS] / LOOPPERIOD + 1))
+				logmsg(FATAL, "FATAL " PROGNAME " Out of memory for rolling statistics");
+		// Files are per station: with more than one, suffixed by controller number
+		if (nstations > 1) {
+			sprintf(st->archiveName, ARCHIVEFILE ".%d", st->controllernum);
+			sprintf(st->statsName, STATSFILE ".%d", st->controllernum);
+		} else {
+			strcpy(st->archiveName, ARCHIVEFILE);
+			strcpy(st->statsName, STATSFILE);
+		}
+		metricsReset(&st->metrics);
+		if (storeName) {
+			char name[200];
+			if (nstations > 1)
+				snprintf(name, sizeof(name), "%s.%d", storeName, st->controllernum);
+			else
+				snprintf(name, sizeof(name), "%s", storeName);
+			if (storeOpen(&st->store, name, STORERECORDS)) {
+				sprintf(buffer, "ERROR " PROGNAME " %d Can't open store %s: %s", st->controllernum, name, strerror(errno));
+				logmsg(ERROR, buffer);
+			} else
+				st->storeOpen = 1;
+		}
+		
+		// Open serial port
+		st->online = 1;
+		if ((st->commfd = openSerial(st->serialName, BAUD, 0, CS8, 1)) < 0) {
+			sprintf(buffer, "ERROR " PROGNAME " %d Failed to open %s: %s", st->controllernum, st->serialName, strerror(errno));
 #ifdef DEBUGCOMMS
-		logmsg(INFO, buffer);			// FIXME AFTER TEST
-		printf("Using stdio\n");
-		commfd = 0;		// use stdin
+			logmsg(INFO, buffer);			// FIXME AFTER TEST
+			printf("Using stdio\n");
+			st->commfd = 0;		// use stdin
 #else
-		logmsg(FATAL, buffer);
+			if (nstations == 1) logmsg(FATAL, buffer);
+			logmsg(ERROR, buffer);		// keep serving the others; serialTick retries
+			st->reopenTime = time(NULL) + REOPENRETRY;
 #endif
+		} else
+			serialOpened();
+		DEBUG fprintf(stderr,"Station %d commfd = %d ", st->controllernum, st->commfd);
 	}
+	st = stations;		// messages not about a station are tagged as the first
 
 	// If we failed to open the logfile and were NOT called with nolog, warn server
 	// Obviously don't use logmsg!
@@ -181,94 +488,92 @@ int main(int argc, char *argv[])
 		sprintf(buffer, "event WARN " PROGNAME " %d could not open logfile %s: %s", controllernum, LOGFILE, strerror(logerror));
 		sockSend(sockfd[0], buffer);
 	}
+	
+	// From here on the publisher thread owns writes to the server, and
+	// opens and finishes with the socket.  This thread reads it, and closes
+	// it once the publisher hands it back through handoff.
+	if (!noserver && sockfd[0] > 0) server = sockfd[0];
+	outInit(&out, noserver);		// with -s text goes to stdout as lines
+	sqInit(&sendq, SENDQHIGH, sendPolicy);
+	if (pipe(handoff) < 0 || fcntl(handoff[0], F_SETFL, O_NONBLOCK) < 0
+		|| spscInit(&pub, PUBSLOTS) || pthread_create(&publisher, NULL, publishLoop, NULL))
+		logmsg(FATAL, "FATAL " PROGNAME " Can't start publisher thread");
+	logHook = logEvent;
+	if (logAsync(LOGSLOTS, pub.wake[1]))
+		logmsg(WARN, "WARN " PROGNAME " Can't queue log messages - logging directly");
+	
+	for (st = stations; st < stations + nstations; st++) {
+		eeRequest(J_LOG);		// configuration, and log the archive interval
+		// Resume an archive download if one has been done before
+		if (access(st->archiveName, F_OK) == 0)
+			jobAdd(J_DMPAFT, 0, 0);
+		if (!streaming) jobAdd(J_LOOP, 0, 0);	// first sample now, then on the boundaries
+		taskStart(&st->task[T_REALTIME], streaming ? 0 : tmout, jitter);
+		taskStart(&st->task[T_HILOW], HILOWINTERVAL, jitter);
+		taskStart(&st->task[T_GRAPH], GRAPHINTERVAL, jitter);
+		taskStart(&st->task[T_STATS], STATSINTERVAL, jitter);
+	}
+	st = stations;
+	schedfd = schedOpen();
 		
-	numfds = (sockfd[0] > commfd ? sockfd[0] : commfd) + 1;		// nfds parameter to select. One more than highest descriptor
-	DEBUG fprintf(stderr,"Commfd = %d, numfds = %d ", commfd, numfds);
-
-	// Main Loop
-	FD_ZERO(&readfd); 
-	iov[0].iov_base = &length;
-	iov[0].iov_len = 2;
-	nextRealTime = time(NULL);
+	// Main Loop.  Nothing here waits except poll(): serial transactions,
+	// server messages and scheduled polls each advance as their data or
+	// timeout arrives.
 	while(run) {
-		int n;
-		timeout.tv_sec = 10;
-		timeout.tv_usec = 0;
-		FD_SET(sockfd[0], &readfd);		// wait for socket input only.
-		FD_SET(commfd, &readfd);
-		timeout.tv_sec = nextRealTime - time(NULL);	// first time around, this is zero.
-		n = select(numfds, &readfd, NULL, NULL, &timeout);	// select timed out.
-		DEBUG fprintf(stderr, "timeout Select returned %d ", n);
-		if (n == -1)
-			DEBUG fprintf(stderr, "Error %s sockfd %d commfd %d numfds %d\n", strerror(errno), sockfd[0], commfd, numfds); 
-		if (time(NULL) >= nextRealTime) {	// Get the next RealTime record every 60 seconds
-			DEBUG 
-				if (FD_ISSET(commfd, &readfd)) fprintf(stderr,"Commfd readable ... ");
-			wakeup(commfd);
-			sendSerial(commfd, "LOOP 1\n");
-			FD_SET(commfd, &readfd);
-			timeout.tv_sec = 10;	// up to 10 seconds for Davis response.
-			if (n = select(numfds, &readfd, NULL, NULL, &timeout)) {	// select has data on commfd
-				online = 1;
-				if (n < 0) perror("davis commfd select");
-				DEBUG fprintf(stderr, "commfd Select returned %d ", n);
-				data.count = 0;
-				getbuf(100, 2000);
-				if (data.count != 100) {
-					DEBUG fprintf(stderr, "Got %d instead of 99 - ignoring packet\n", data.count);
-					continue;
-				}
-				
-				if (data.buf[0] != ACK) {
-					DEBUG fprintf(stderr, "Byte[0] is %02x not ACK - ignoring packet\n", data.buf[0]);
-					continue;
-				}
-				if (checkCRC(99, data.buf + 1)) {
-					DEBUG fprintf(stderr, "CRC failed\n");
-					continue;
-				}
-				
-				iov[1].iov_base = "davis realtime";
-				iov[1].iov_len = 15; // includes trailing \0
-				iov[2].iov_base = data.buf + 1;
-				iov[2].iov_len = 97;	// don't send CRC
-				length = htons(15 + 97);	// = 112
-				if (sockfd[0]) 
-					num = writev(sockfd[0], iov, 3);
-				
-				DEBUG fprintf(stderr, "Davis realtime: sent %d bytes\n" , num);
-				DEBUG dumphex(99, data.buf+1);
-				DEBUG writepacket(data.buf+1);
-			} 
-			else	// select timed out
-			{
-				if (online) {
-					logmsg(WARN, "WARN " PROGNAME " no data for last period .. reopening port");
-					online = 0;
-					do {
-						close(commfd);
-						sleep(10);
-						if ((commfd = openSerial(serialName, B19200, 0, CS8, 1)) < 0) {
-							sprintf(buffer, "ERROR " PROGNAME " %d Failed to re-open %s: %s", controllernum, serialName, strerror(errno));
-							logmsg(ERROR, buffer);
-							sleep(150);
-						}
-						
-					} while (commfd < 0);
-				}
+		int n = 0, t = 60000, i, reading;
+		long long due = 0;			// earliest scheduled poll
+		for (st = stations; st < stations + nstations; st++) {
+			serialTick();
+			if ((i = pollTimeout()) < t) t = i;
+			for (i = 0; i < T_NUM; i++)
+				if (st->task[i].interval && (due == 0 || st->task[i].due < due)) due = st->task[i].due;
+			if (st->commfd >= 0) {		// closed while waiting to reopen
+				fds[n].fd = st->commfd;
+				fds[n++].events = POLLIN;
 			}
-			nextRealTime = timeMod(tmout);
-			DEBUG fprintf(stderr, "Sleeping %zu ... \n", nextRealTime - time(NULL));
-			// Wait until next period - but awaken if a socket message comes in
 		}
-		else sleep(10);		// To avoid race condition
-		
-		if ((noserver == 0) && FD_ISSET(sockfd[0], &readfd))
-			run = processSocket();	// the server may request a shutdown by setting run to 0
+		fds[n].fd = handoff[0];
+		fds[n++].events = POLLIN;
+		if ((reading = !noserver && server > 0 && serverEOF != server)) {	// with -s it is stdout
+			fds[n].fd = server;
+			fds[n++].events = POLLIN;
+		}
+		if (schedfd >= 0) {
+			schedArm(schedfd, due);
+			fds[n].fd = schedfd;
+			fds[n++].events = POLLIN;
+		}
+		if ((n = poll(fds, n, t)) < 0) {
+			if (errno != EINTR) DEBUG fprintf(stderr, "Poll error %s sockfd %d\n", strerror(errno), server);
+			continue;
+		}
+		if (n == 0) continue;		// timeouts are dealt with by serialTick
+		n = 0;
+		for (st = stations; st < stations + nstations; st++)
+			if (st->commfd >= 0 && fds[n++].revents) {	// POLLHUP and POLLERR too: the read reports them
+				if (fillframer() > 0) serialInput();
+			}
+		st = stations;
+		if (fds[n++].revents)
+			server = serverHandoff(server);	// before reading: it may have been handed back
+		if (reading && (fds[n++].revents & ~POLLNVAL) && server > 0)
+			run = processSocket(server);	// the server may request a shutdown by setting run to 0
+		if (schedfd >= 0 && fds[n].revents)
+			schedAck(schedfd);		// the tasks themselves run in serialTick
 	}
 	logmsg(INFO,"INFO " PROGNAME " Shutdown requested");
-	close(sockfd[0]);
-	closeSerial(commfd);
+	publishing = 0;			// publisher sends what is waiting then stops
+	write(pub.wake[1], "", 1);
+	pthread_join(publisher, NULL);
+	logHook = NULL;
+	logAsync(0, -1);		// write anything logged since, and log directly again
+	if (queueName) queueClose(&queue);
+	if (captureName) captureClose(&capture);
+	if ((server = serverHandoff(server)) > 0) close(server);
+	for (st = stations; st < stations + nstations; st++) {
+		if (st->storeOpen) storeClose(&st->store);
+		if (st->commfd >= 0) closeSerial(st->commfd);
+	}
 
 	return 0;
 }
@@ -277,39 +582,87 @@ int main(int argc, char *argv[])
 /* USAGE */
 /*********/
 void usage(void) {
-	printf("Usage: davis [-t timeout] [-l] [-s] [-d] [-V] /dev/ttyname controllernum\n");
-	printf("-l: no log  -s: no server  -d: debug on\n -V version\n");
+	printf("Usage: davis [-t timeout] [-j jitter] [-l] [-s] [-S] [-P] [-H secs] [-D secs] [-R] [-T file] [-Q file] [-C file] [-m n[,n,n]] [-B drop|coalesce|spill] [-d] [-V] /dev/ttyname controllernum [/dev/ttyname controllernum ...]\n");
+	printf("-l: no log  -s: no server  -d: debug on  -S: streaming (continuous LOOP)\n");
+	printf("-P: packet reads - each read waits for the whole frame (or %d mSec quiet)\n", FRAMEGAP);
+	printf("-j: seconds after each interval boundary to poll (realtime, hilow %d, graph %d)\n", HILOWINTERVAL, GRAPHINTERVAL);
+	printf("-H: seconds to serve cached hilow (default %d)\n", HILOWFRESH);
+	printf("-D: only send realtime when a value passes its deadband, or after this many seconds\n");
+	printf("-R: send 1 min, 10 min and 1 hour rolling statistics with realtime\n");
+	printf("-T: keep every LOOP packet in a local store file (%d records)\n", STORERECORDS);
+	printf("-Q: queue file for messages while the server is down (default " QUEUEFILE ")\n -V version\n");
+	printf("-C: capture every byte read from the consoles to file, for the replay tool\n");
+	printf("-B: when the server stalls, drop the oldest realtime, keep only the latest, or spill to the queue (default)\n");
+	printf("-m: each message at most n times in %d seconds, then a count of repeats (or info,warn,error)\n", LOGWINDOW);
+	printf("With up to %d consoles, messages are from davis.controllernum and a command may start with one\n", MAXSTATIONS);
+	printf("Counters and latency histograms are written to " STATSFILE " every %d seconds\n", STATSINTERVAL);
 	return;
 }
 
 /*****************/
 /* PROCESSSOCKET */
 /*****************/
-int processSocket(){
-	// Deal with commands from MCP.  Return to 0 to do a shutdown
-	// Handle graph and hilow commands.
-	short int msglen, numread;
-	char buffer[128], buffer2[192];	// about 128 is good but rather excessive since longest message is 'truncate'
-	char * cp = &buffer[0];
-	int retries = NUMRETRIES;
+int processSocket(int fd){
+	// Read what the MCP has sent.  A message split across reads waits
+	// in sockbuf for the rest instead of holding up the main loop.
+	// Return 0 to do a shutdown.
+	short int msglen;
+	char buffer[128];	// about 128 is good but rather excessive since longest message is 'truncate'
 	int num;
 	
-	if (read(sockfd[0], &msglen, 2) != 2) {
-		logmsg(WARN, "WARN " PROGNAME " Failed to read length from socket");
+	if ((num = read(fd, sockbuf + sockhave, sizeof(sockbuf) - sockhave)) <= 0) {
+		if (num == 0) {		// server closed the connection - publisher reconnects
+			serverEOF = fd;
+			write(pub.wake[1], "", 1);
+		}
+		else if (errno != EINTR && errno != EAGAIN)
+			logmsg(WARN, "WARN " PROGNAME " Failed to read from socket");
 		return 1;
 	}
-	msglen =  ntohs(msglen);
-	while ((numread = read(sockfd[0], cp, msglen)) < msglen) {
-		cp += numread;
-		msglen -= numread;
-		if (--retries == 0) {
-			logmsg(WARN, "WARN " PROGNAME " Timed out reading from server");
-			return 1;
+	sockhave += num;
+	while (sockhave >= 2) {
+		memcpy(&msglen, sockbuf, 2);
+		msglen = ntohs(msglen);
+		if (msglen < 0 || msglen >= sizeof(buffer)) {
+			logmsg(WARN, "WARN " PROGNAME " Bad message length from server - discarding");
+			sockhave = 0;
+			break;
 		}
-		usleep(RETRYDELAY);
+		if (sockhave < 2 + msglen) break;		// rest still to come
+		memcpy(buffer, sockbuf + 2, msglen);
+		buffer[msglen] = '\0';	// terminate the buffer 
+		sockhave -= 2 + msglen;
+		memmove(sockbuf, sockbuf + 2 + msglen, sockhave);
+		if (processCommand(buffer) == 0) return 0;
 	}
-	cp[numread] = '\0';	// terminate the buffer 
+	return 1;
+}
+
+/******************/
+/* PROCESSCOMMAND */
+/******************/
+int processCommand(char * buffer) {
+	// Deal with one command from MCP.  Return to 0 to do a shutdown
+	// Commands that need the console queue a job and return at once;
+	// the job sends the reply when it completes.  In multi-station mode
+	// a leading controller number picks the console, eg "3 hilow";
+	// otherwise it is the first.
+	char buffer2[300];	// buffer2 also holds the hilow reply
+	int num;
 	
+	st = stations;
+	if (isdigit(*buffer)) {
+		num = strtol(buffer, &buffer, 10);
+		while (*buffer == ' ') buffer++;
+		for (st = stations; st < stations + nstations; st++)
+			if (st->controllernum == num) break;
+		if (st == stations + nstations) {
+			st = stations;
+			sprintf(buffer2, "INFO " PROGNAME " No station %d for command %s", num, buffer);
+			logmsg(INFO, buffer2);
+			return 1;
+		}
+	}
 	if (strcasecmp(buffer, "exit") == 0)
 		return 0;	// Terminate program
 	if (strcasecmp(buffer, "Ok") == 0)
@@ -333,38 +686,88 @@ int processSocket(){
 		return 1;
 	}
 	if (strcasecmp(buffer, "help") == 0 || *buffer == '?') {
-		logmsg(INFO, "INFO: Available commands are exit; truncate; debug 0|1; interval; hilow; graph; loop");
+		logmsg(INFO, "INFO: Commands: exit; truncate; debug 0|1; interval; hilow; graph; config; loop; archive; deadband; rolling; history; wake; stats; trace N. Prefix N for station N");
 		return 1;
 	}
 	if (strcasecmp(buffer, "hilow") == 0) {
-		wakeup(commfd);
-		sendSerial(commfd, "HILOWS\n");
-		getbuf(438, 1000);
-		DEBUG fprintf(stderr, "" PROGNAME " hilow: sent %d bytes\n" , num);
-		dumphex(436, data.buf);
-		logmsg(INFO, "INFO " PROGNAME " written file " DUMPFILE);
+		if (st->hilowsTime && time(NULL) - st->hilowsTime < hilowFresh) {
+			DEBUG fprintf(stderr, "Hilow from cache, %ld sec old\n", (long)(time(NULL) - st->hilowsTime));
+			replyHilows();
+		} else
+			jobAdd(J_HILOWS, J_REPLY, 0);
 		return 1;
 	}
 	if (strcasecmp(buffer, "graph") == 0) {
-		wakeup(commfd);
-		sendSerial(commfd, "GETEE\n");
-		getbuf(4098, 1000);	// include checksum
-		DEBUG fprintf(stderr, "Davis graph: sent %d bytes\n" , num);
-		dumphex(4098, data.buf);
-		logmsg(INFO, "INFO " PROGNAME " written file " DUMPFILE);
+		eeRequest(J_DUMP);
+		return 1;
+	}
+	if (strcasecmp(buffer, "config") == 0) {
+		eeRequest(J_REPLY);
 		return 1;
 	}
 	if (strcasecmp(buffer, "loop") == 0) {
-		wakeup(commfd);
-		sendSerial(commfd, "LOOP 1\n");
-		getbuf(99, 1000);
-		dumphex(99, data.buf);
-		logmsg(INFO, "INFO " PROGNAME " written file " DUMPFILE);
+		jobAdd(J_LOOP, J_DUMP, 0);
+		return 1;
+	}
+	if (strcasecmp(buffer, "archive") == 0) {
+		jobAdd(J_DMPAFT, J_REPLY, 0);
+		return 1;
+	}
+	if (strncasecmp(buffer, "history ", 8) == 0) {	// history time [count]
+		char * cp2;
+		time_t since = strtol(buffer + 8, &cp2, 0);
+		num = strtol(cp2, NULL, 0);
+		if (num <= 0 || num > HISTORYMAX) num = HISTORYMAX;
+		sendHistory(since, num);
+		return 1;
+	}
+	if (strcasecmp(buffer, "rolling") == 0) {
+		sendRolling();
+		return 1;
+	}
+	if (strcasecmp(buffer, "wake") == 0) {	// wakeups needed, skipped, failed skips, last max mean mSec
+		struct histogram * h = &st->metrics.hist[H_WAKE];
+		sprintf(buffer2, "davis wake %d %d %d %d %d %d", h->count, st->metrics.counter[M_WAKESKIP], 
+			st->metrics.counter[M_WAKEFAIL], h->last, h->max, histMean(h));
+		sendText(buffer2);
+		return 1;
+	}
+	if (strncasecmp(buffer, "trace", 5) == 0) {	// last N cycles, oldest first
+		num = atoi(buffer + 5);
+		if (num <= 0) num = 10;
+		while (--num >= 0) 
+			if (traceFormat(&trace, num, buffer2 + 12, sizeof(buffer2) - 12)) {
+				memcpy(buffer2, "davis trace ", 12);
+				sendText(buffer2);
+			}
+		return 1;
+	}
+	if (strcasecmp(buffer, "stats") == 0) {
+		strcpy(buffer2, "davis stats ");
+		statsFormat(buffer2 + 12, sizeof(buffer2) - 12);
+		sendText(buffer2);
+		return 1;
+	}
+	if (strncasecmp(buffer, "deadband ", 9) == 0) {	// deadband field value
+		char * cp2 = strchr(buffer + 9, ' ');
+		if (cp2) *cp2++ = '\0';
+		for (num = 0; num < LF_NUM; num++)
+			if (strcasecmp(buffer + 9, loopfields[num].name) == 0) break;
+		if (num == LF_NUM || cp2 == NULL) {
+			logmsg(INFO, "INFO " PROGNAME " Usage: deadband field value (in field units, eg outtemp 1 = 0.1F)");
+			return 1;
+		}
+		deadband[num] = atoi(cp2);
+		sprintf(buffer2, "INFO " PROGNAME " Deadband for %s set to %d", loopfields[num].name, deadband[num]);
+		logmsg(INFO, buffer2);
 		return 1;
 	}
 	if (strncasecmp(buffer, "interval ", 9) == 0) {
+		struct station * s;		// st stays the station the command is for
 		tmout = strtol(buffer+9, NULL, 0);
 		if (tmout == 0) tmout = 60;
+		for (s = stations; !streaming && s < stations + nstations; s++)
+			taskStart(&s->task[T_REALTIME], tmout, jitter);
 		sprintf(buffer, "INFO " PROGNAME " Interval set to %d seconds", tmout);
 		logmsg(INFO, buffer);
 		return 1;
@@ -403,7 +806,7 @@ int sendSerial(int fd, char *data) {
 	return 0;
 #endif
 	DEBUG fprintf(DEBUGFP, "Sending %zu bytes: %s", len, data);
-	while ((written = write(fd, data, len)) < len) {
+	while ((written = write(fd, data, len)) < (int)len) {
         fprintf(DEBUGFP, "Serial wrote %d bytes errno = %d", written, errno);
         perror("");
 		if (--retries == 0) {
@@ -416,57 +819,25 @@ int sendSerial(int fd, char *data) {
 	return 0;       // ok
 }
 
-/**********/
-/* GETBUF */
-/**********/
-int getbuf(int max, int tmout) {
-	// Read up to max chars into supplied buf. Return number
-	// of chars read or negative error code if applicable
-	int ready, numtoread, now;
-	fd_set readfd; 
-	struct timeval timeout;
-	FD_ZERO(&readfd);
-	// data.escape = 0;
-	// numread = 0;
-	numtoread = max;
-	DEBUG2 fprintf(stderr, "Getbuf entry %d count=%d ", max ,data.count);
-	
-	while(1) {
-		FD_SET(commfd, &readfd);
-		timeout.tv_sec = tmout / 1000;
-		timeout.tv_usec = (tmout % 1000) * 1000;	 // 0.5sec
-		ready = select(commfd + 1, &readfd, NULL, NULL, &timeout);
-		DEBUG4 {
-			gettimeofday(&timeout, NULL);
-			fprintf(stderr, "%03ld.%03d ", timeout.tv_sec%100, timeout.tv_usec / 1000);
-		}
-		if (ready == 0) {
-			DEBUG2 fprintf(stderr, "Gotbuf %d bytes ", data.count);
-			return data.count;		// timed out - return what we've got
-		}
-		DEBUG4 fprintf(stderr, "Getbuf: before read1 ");
-		now = read(commfd, data.buf + data.count, 1);
-		DEBUG4 fprintf(stderr, "After read1\n");
-		DEBUG3 fprintf(stderr, "0x%02x ", data.buf[data.count]);
-		if (now < 0)
-			return now;
-		if (now == 0) {
-			fprintf(stderr, "ERROR fd was ready but got no data\n");
-			// VBUs / LAN  - can't use standard Reopenserial as device name hostname: port is not valid
-			commfd = reopenSerial(commfd, serialName, BAUD, 0, CS8, 1);
-			continue;
-		}
-		
-		data.count += now;
-		numtoread -= now;
-		DEBUG3 fprintf(stderr, "[%d] ", data.count - now);
-		if (numtoread == 0) return data.count;
-		if (numtoread < 0) {	// CANT HAPPEN
-			fprintf(stderr, "ERROR buffer overflow - increase max from %d (numtoread = %d numread = %d)\n", 
-					max, numtoread, data.count);
-			return data.count;
-		}
+/**************/
+/* FILLFRAMER */
+/**************/
+int fillframer(void) {
+	// Read whatever is waiting on commfd.  Return number of bytes.
+	int now = frameFill(&st->framer, st->commfd);
+	DEBUG3 fprintf(stderr, "Read %d ", now);
+	if (captureName && now > 0 && 
+		captureWrite(&capture, st->controllernum, st->framer.ring + ((st->framer.head - now) & RINGMASK), now)) {
+		logmsg(ERROR, "ERROR " PROGNAME " Capture file write failed - capture stopped");
+		captureClose(&capture);
+		captureName = NULL;
+	}
+	if (now == 0) {
+		fprintf(stderr, "ERROR fd was ready but got no data\n");
+		// VBUs / LAN  - can't use standard Reopenserial as device name hostname: port is not valid
+		reopen();
 	}
+	return now;
 }
 
 /*************/
@@ -486,7 +857,7 @@ int getBuffer(char *buf, int size) {
 	fd_set fdset;
 	struct timeval timeout;
 	sleep(1);
-	if ((numread = read(commfd, buf, 1)) != 1) {	// commfd should be readable to get here
+	if ((numread = read(st->commfd, buf, 1)) != 1) {	// commfd should be readable to get here
 		sprintf(buffer, "WARN " PROGNAME " couldn't read initial ACK byte - only got %d bytes", numread);
 		logmsg(WARN, buffer);
 		return 1;
@@ -512,13 +883,13 @@ int getBuffer(char *buf, int size) {
 	while (numtoread > 0) {		// 1.7 changed to > 0 instead of != 0
 		timeout.tv_sec = 0;
 		timeout.tv_usec = 100000;	// 100mS
-		FD_SET(commfd, &fdset);
-		num = select(commfd+1, &fdset, NULL, NULL, &timeout);
+		FD_SET(st->commfd, &fdset);
+		num = select(st->commfd+1, &fdset, NULL, NULL, &timeout);
 		if (num == 0) {
 			DEBUG fprintf(stderr, "Timed out with %d read", numread);
 			return 1;
 		}
-		if ((numread = read(commfd, ptr, numtoread)) < 0) {	// error
+		if ((numread = read(st->commfd, ptr, numtoread)) < 0) {	// error
 			perror("");
 			return 1;
 		}
@@ -537,27 +908,1058 @@ int getBuffer(char *buf, int size) {
 }
 
 /**********/
-/* WAKEUP */
+/* JOBADD */
 /**********/
-int wakeup(int commfd) { 
-// try and wake up Davis. 0 is success.
-// 
+int jobAdd(int type, int flags, int next) {
+// Queue a serial transaction, at the end or (next = 1) straight after the
+// running one.  A running stream gives way at once.  Return 0 if queued,
+// 1 if the same job is already waiting or there is no room.
 	int i;
-	char buf[2];
-	struct timeval timeout;
-	fd_set fd;
-	FD_ZERO(&fd);
-	for (i=1; i < 3; i++) {
-		timeout.tv_sec = 1;
-		timeout.tv_usec = 500000;
-		FD_SET(commfd, &fd);
-		sendSerial(commfd, "\n");
-		if (select(commfd+1, &fd, NULL, NULL, &timeout) == 1) {	// data ready
-			if (read(commfd, buf, 2) == 2) return 0;
-			else fprintf(stderr, "Error - only read 1 byte (0x%02x) in response to wakeup\n", buf[0]);
+	char buffer[100];
+	for (i = 1; i < st->njobs; i++)
+		if (st->job[i].type == type && st->job[i].flags == flags) return 1;
+	if (st->njobs == JOBS) {
+		sprintf(buffer, "WARN " PROGNAME " %d console busy - job %d dropped", st->controllernum, type);
+		logmsg(WARN, buffer);
+		return 1;
+	}
+	if (next && st->njobs > 1) {
+		memmove(&st->job[2], &st->job[1], (st->njobs - 1) * sizeof(struct job));
+		i = 1;
+	} else
+		i = st->njobs;
+	st->job[i].type = type;
+	st->job[i].flags = flags;
+	st->njobs++;
+	DEBUG2 fprintf(stderr, "Job %d flags %d queued at %d\n", type, flags, i);
+	if (st->njobs == 1)
+		jobStart();
+	else if (st->state == S_STREAM) {	// a wakeup cancels the LOOP
+		stopLoop();
+		jobDone();
+	}
+	return 0;
+}
+
+/**************/
+/* JOBWAITING */
+/**************/
+int jobWaiting(int type) {
+	int i;
+	for (i = 1; i < st->njobs; i++)
+		if (st->job[i].type == type) return 1;
+	return 0;
+}
+
+/************/
+/* JOBSTART */
+/************/
+void jobStart(void) {
+// Wake the console for job[0], unless it is still awake from the last
+// one, so jobs queued together share a wake session.  The reply arrives
+// in serialInput.
+	if (st->njobs == 0 || st->commfd < 0) return;	// serialTick starts it after reopening
+	frameReset(&st->framer);	// anything buffered predates this command
+	st->cycle = traceStart(&trace, st->controllernum, st->job[0].type);
+	st->tries = WAKETRIES;
+	st->step = D_ACK;
+	if (msNow() < st->awakeUntil) {
+		DEBUG2 fprintf(stderr, "Console awake for %lld mSec - no wakeup\n", st->awakeUntil - msNow());
+		st->metrics.counter[M_WAKESKIP]++;
+		st->woken = 0;
+		jobSend();
+		return;
+	}
+	st->woken = 1;
+	st->state = S_WAKE;
+	st->wakeStart = msNow();
+	st->deadline = st->wakeStart + WAKETIME;
+	frameMode();
+	traceMark(&trace, st->cycle, TR_WAKESTART);
+	sendSerial(st->commfd, "\n");
+}
+
+/***********/
+/* JOBSEND */
+/***********/
+void jobSend(void) {
+// The console is awake: send the command for job[0]
+	char cmd[20];
+	FILE * f;
+	unsigned int date = 0, tm = 0;
+	switch (st->job[0].type) {
+	case J_LOOP:
+		sendSerial(st->commfd, "LOOP 1\n");
+		expect(FRAME_LOOP, LOOPSIZE, 3000);
+		break;
+	case J_STREAM:	// The console sends a single ACK then a 99-byte packet every
+					// 2 seconds; the framer skips the ACK.
+		sprintf(cmd, "LOOP %d\n", LOOPCOUNT);
+		sendSerial(st->commfd, cmd);
+		DEBUG fprintf(stderr, "Streaming %d packets\n", LOOPCOUNT);
+		st->loopsLeft = LOOPCOUNT;
+		st->state = S_STREAM;
+		st->deadline = msNow() + STREAMTIMEOUT * 1000;
+		st->sentAt = msNow();
+		st->gotFirst = 0;
+		traceMark(&trace, st->cycle, TR_SENT);
+		frameMode();
+		break;
+	case J_HILOWS:
+		sendSerial(st->commfd, "HILOWS\n");
+		expect(FRAME_ACK, HILOWSIZE + 2, 2000);		// include CRC
+		break;
+	case J_EESIG:	// Cheap check that the cache is current: the unit, setup and archive
+					// period bytes change whenever the console is reconfigured.
+		sprintf(cmd, "EEBRD %02X %02X\n", EE_UNITBITS, EE_SIGLEN);
+		sendSerial(st->commfd, cmd);
+		expect(FRAME_ACK, EE_SIGLEN + 2, 1000);
+		break;
+	case J_EECONFIG:	// Much quicker than GETEE when only a few fields are wanted.
+		sprintf(cmd, "EEBRD %02X %02X\n", EE_CONFIG, EE_CONFIGLEN);
+		sendSerial(st->commfd, cmd);
+		expect(FRAME_ACK, EE_CONFIGLEN + 2, 1000);
+		break;
+	case J_GETEE:
+		sendSerial(st->commfd, "GETEE\n");
+		expect(FRAME_ACK, EESIZE + 2, 4000);	// include checksum
+		break;
+	case J_DMPAFT:
+		if ((f = fopen(st->archiveName, "r"))) {
+			if (fscanf(f, "%u %u", &date, &tm) != 2) date = tm = 0;
+			fclose(f);
 		}
+		st->last = (date << 16) | tm;
+		st->sent = st->done = 0;
+		DEBUG fprintf(stderr, "DMPAFT date %04x time %04d\n", date, tm);
+		sendSerial(st->commfd, "DMPAFT\n");
+		expect(FRAME_ACK, 0, 2000);		// wait for ACK before sending the date stamp
+		break;
 	}
-	return 1;
+}
+
+/**********/
+/* EXPECT */
+/**********/
+void expect(int type, int size, int tmout) {
+// Wait up to tmout mSec for a frame of type and size (see frameGet)
+	st->state = S_REPLY;
+	st->expect = type;
+	st->size = size;
+	st->deadline = msNow() + tmout;
+	st->sentAt = msNow();
+	st->gotFirst = 0;
+	traceMark(&trace, st->cycle, TR_SENT);
+	frameMode();
+}
+
+/***************/
+/* SERIALINPUT */
+/***************/
+void serialInput(void) {
+// New bytes are in the framer.  Move the running job on as far as they allow.
+	int r;
+	long long now = msNow();
+	st->awakeUntil = now + AWAKETIME;	// it has just sent something
+	if (!st->gotFirst && st->state != S_WAKE) {
+		if (st->sentAt) histAdd(&st->metrics.hist[H_FIRSTBYTE], now - st->sentAt);
+		traceMark(&trace, st->cycle, TR_FIRST);
+		st->gotFirst = 1;
+		st->woken = 1;		// any reply at all means it is awake
+	}
+	traceMark(&trace, st->cycle, TR_LAST);
+	pub.mark = st->cycle;		// the publisher marks TR_WRITTEN for what this sends
+	switch (st->state) {
+	case S_WAKE:
+		if (frameGet(&st->framer, FRAME_WAKE, 0, data.buf)) {
+			histAdd(&st->metrics.hist[H_WAKE], now - st->wakeStart);
+			traceMark(&trace, st->cycle, TR_WAKEEND);
+			DEBUG2 fprintf(stderr, "Wakeup took %lld mSec\n", now - st->wakeStart);
+			frameReset(&st->framer);
+			jobSend();
+		}
+		break;
+	case S_REPLY:		// loop as DMPAFT may already have the next page
+		while (st->state == S_REPLY && (r = frameGet(&st->framer, st->expect, st->size, data.buf))) {
+			if (r > 0 && st->sentAt) {
+				histAdd(&st->metrics.hist[H_FRAME], now - st->sentAt);
+				st->sentAt = 0;
+			}
+			if (r > 0) traceMark(&trace, st->cycle, TR_CRC);
+			data.count = st->size;
+			jobStep(r);
+		}
+		break;
+	case S_STREAM:
+		while (frameGet(&st->framer, FRAME_LOOP, LOOPSIZE, data.buf) > 0) {
+			if (st->sentAt) {		// only the first packet answers the command
+				histAdd(&st->metrics.hist[H_FRAME], now - st->sentAt);
+				st->sentAt = 0;
+			}
+			traceMark(&trace, st->cycle, TR_CRC);
+			st->loopsLeft--;
+			st->online = 1;
+			st->misses = 0;
+			st->deadline = msNow() + STREAMTIMEOUT * 1000;
+			processLoop(data.buf);
+			// each further packet is a cycle of its own, without a command
+			st->cycle = pub.mark = st->loopsLeft > 0 ? traceStart(&trace, st->controllernum, J_STREAM) : 0;
+			st->gotFirst = 0;
+		}
+		DEBUG2 fprintf(stderr, "Framer: %d discarded %d CRC failures\n", st->framer.discarded, st->framer.crcfails);
+		if (st->loopsLeft <= 0) jobDone();		// serialTick re-arms
+		break;
+	default:			// nothing asked for
+		frameReset(&st->framer);
+	}
+	pub.mark = 0;
+	frameMode();		// what is left of a partial frame
+}
+
+/**************/
+/* SERIALTICK */
+/**************/
+void serialTick(void) {
+// Called every time round the main loop.  Reopen a closed port, queue
+// the scheduled polls and deal with a job that has run out of time.
+	char buffer[128];
+	long long now = msNow();
+	if (st->commfd < 0 && time(NULL) >= st->reopenTime) {
+		if ((st->commfd = openSerial(st->serialName, BAUD, 0, CS8, 1)) < 0) {
+			sprintf(buffer, "ERROR " PROGNAME " %d Failed to re-open %s: %s", st->controllernum, st->serialName, strerror(errno));
+			logmsg(ERROR, buffer);
+			st->reopenTime = time(NULL) + REOPENRETRY;
+		} else {
+			serialOpened();
+			jobStart();
+		}
+	}
+	if (streaming) {
+		if (st->njobs == 0) jobAdd(J_STREAM, 0, 0);
+	} else if (taskDue(&st->task[T_REALTIME], now)) {	// Get the next RealTime record every interval
+		jobAdd(J_LOOP, 0, 1);		// ahead of anything else waiting
+		DEBUG fprintf(stderr, "Next realtime in %lld mSec\n", st->task[T_REALTIME].due - now);
+	}
+	if (taskDue(&st->task[T_HILOW], now))
+		jobAdd(J_HILOWS, J_REPLY, 0);
+	if (taskDue(&st->task[T_GRAPH], now))
+		eeRequest(0);		// refresh the EEPROM cache if the console has been reconfigured
+	if (taskDue(&st->task[T_STATS], now))
+		statsWrite();
+	if (st->commfd < 0 || st->state == S_IDLE || msNow() < st->deadline) return;
+	switch (st->state) {
+	case S_WAKE:
+		if (--st->tries > 0) {
+			st->deadline = msNow() + WAKETIME;
+			sendSerial(st->commfd, "\n");
+		} else {
+			DEBUG fprintf(stderr, "No response to wakeup\n");
+			st->metrics.counter[M_TIMEOUT]++;
+			jobStep(0);
+		}
+		break;
+	case S_REPLY:
+		DEBUG2 fprintf(stderr, "Job %d timed out with %d bytes ", st->job[0].type, frameAvail(&st->framer));
+		if (frameAvail(&st->framer)) st->metrics.counter[M_SHORT]++;
+		if (!st->woken) {		// not a byte back: it had gone to sleep after all - wake it and start again
+			st->metrics.counter[M_WAKEFAIL]++;
+			st->awakeUntil = 0;
+			jobStart();
+			break;
+		}
+		st->metrics.counter[M_TIMEOUT]++;
+		jobStep(0);
+		break;
+	case S_STREAM:		// console has stopped looping
+		if (!st->woken) {
+			st->metrics.counter[M_WAKEFAIL]++;
+			st->awakeUntil = 0;
+			jobStart();
+			break;
+		}
+		if (++st->misses >= STREAMMISSES && st->online) {
+			stationWarn("no data in streaming mode .. reopening port");
+			st->online = 0;
+			reopen();
+		}
+		jobDone();
+		break;
+	}
+}
+
+/***************/
+/* POLLTIMEOUT */
+/***************/
+int pollTimeout(void) {
+// mSec until the earliest of: the running job's deadline, the next scheduled
+// poll, and reopening the port.
+	long long t = 60000, ms = msNow();
+	int i;
+	if (st->state != S_IDLE && st->deadline - ms < t) t = st->deadline - ms;
+	for (i = 0; schedfd < 0 && i < T_NUM; i++)		// no timerfd
+		if (st->task[i].interval && st->task[i].due - ms < t) t = st->task[i].due - ms;
+	if (st->commfd < 0 && (st->reopenTime - time(NULL)) * 1000 < t) t = (st->reopenTime - time(NULL)) * 1000;
+	return t < 0 ? 0 : t;
+}
+
+/***********/
+/* JOBSTEP */
+/***********/
+void jobStep(int result) {
+// The frame job[0] was waiting for is in data.buf (result 1), failed its
+// CRC (-1) or never came (0).  Act on it, then finish the job unless it
+// has more steps.
+	struct job * j = &st->job[0];
+	char buffer[100];
+	switch (j->type) {
+	case J_LOOP:
+		if (result <= 0) {
+			if (j->flags) stationWarn("no reply to LOOP");
+			else if (st->online) {
+				stationWarn("no data for last period .. reopening port");
+				st->online = 0;
+				reopen();
+			}
+			break;
+		}
+		st->online = 1;
+		if (j->flags & J_DUMP) {
+			dumphex(LOOPSIZE, data.buf);
+			logmsg(INFO, "INFO " PROGNAME " written file " DUMPFILE);
+		} else
+			processLoop(data.buf);
+		break;
+	case J_HILOWS:
+		if (result <= 0) {
+			stationWarn("failed to read HILOWS");
+			break;
+		}
+		DEBUG dumphex(HILOWSIZE, data.buf);
+		decodeHilows(data.buf, &st->hilows);
+		st->hilowsTime = time(NULL);
+		if (j->flags & J_REPLY) replyHilows();
+		break;
+	case J_EESIG:
+		if (result > 0 && memcmp(data.buf, st->eeimage + EE_UNITBITS, EE_SIGLEN) == 0) {
+			eeReport(j->flags);
+			break;
+		}
+		DEBUG fprintf(stderr, "EEPROM configuration has changed\n");
+		jobAdd((j->flags & J_DUMP) ? J_GETEE : J_EECONFIG, j->flags, 1);
+		break;
+	case J_EECONFIG:
+		if (result <= 0) {
+			st->eevalid = 0;
+			stationWarn("failed to read EEPROM configuration");
+			break;
+		}
+		memcpy(st->eeimage + EE_CONFIG, data.buf, EE_CONFIGLEN);
+		decodeEeprom(st->eeimage, &st->eeconfig);
+		st->eevalid = 1;		// rest of the image is not current
+		eeReport(j->flags);
+		break;
+	case J_GETEE:
+		if (result <= 0) {
+			st->eevalid = 0;
+			stationWarn("failed to read EEPROM");
+			break;
+		}
+		DEBUG fprintf(stderr, "Davis graph: got %d bytes\n" , data.count);
+		memcpy(st->eeimage, data.buf, EESIZE);
+		decodeEeprom(st->eeimage, &st->eeconfig);
+		st->eevalid = 2;
+		eeReport(j->flags);
+		break;
+	case J_DMPAFT:
+		if (dmpStep(result) == 0) return;	// more pages to come
+		if (j->flags & J_REPLY) {
+			sprintf(buffer, "INFO " PROGNAME " sent %d archive records", st->sent);
+			logmsg(INFO, buffer);
+		}
+		break;
+	}
+	jobDone();
+}
+
+/***********/
+/* JOBDONE */
+/***********/
+void jobDone(void) {
+// Remove job[0] and start the next one
+	if (st->njobs == 0) return;
+	memmove(&st->job[0], &st->job[1], (st->njobs - 1) * sizeof(struct job));
+	st->njobs--;
+	st->state = S_IDLE;
+	st->cycle = 0;
+	jobStart();
+}
+
+/************/
+/* SENDBYTE */
+/************/
+void sendByte(int c) {
+	unsigned char b = c;
+	write(st->commfd, &b, 1);
+}
+
+/************/
+/* STOPLOOP */
+/************/
+void stopLoop(void) {
+// The next wakeup cancels a running LOOP. Discard anything already
+// received; serialTick re-arms afterwards.
+	st->loopsLeft = 0;
+	st->awakeUntil = 0;		// the wakeup is what stops it
+	tcflush(st->commfd, TCIFLUSH);
+	frameReset(&st->framer);
+}
+
+/***************/
+/* PROCESSLOOP */
+/***************/
+void processLoop(unsigned char * packet) {
+// Decode a validated LOOP packet into loopvalues and forward it
+// unless nothing has changed enough to be worth sending.
+	int i, j;
+	time_t now = time(NULL);
+	loopDecode(packet, st->loopvalues);
+	DEBUG writepacket(st->loopvalues);
+	if (st->storeOpen && storeAppend(&st->store, now, packet))
+		stationWarn("failed to write to store");
+	for (i = 0; i < ROLLFIELDS; i++)
+		if (st->loopvalues[rollfield[i]] != LOOPABSENT)
+			for (j = 0; j < ROLLWINDOWS; j++) 
+				rollAdd(&st->rolls[i][j], now, st->loopvalues[rollfield[i]]);
+	if (!loopChanged()) {
+		st->suppressed++;
+		DEBUG2 fprintf(stderr, "Realtime suppressed (%d)\n", st->suppressed);
+		return;
+	}
+	sendRealtime(packet);
+	if (rollPublish) sendRolling();
+	memcpy(st->lastsent, st->loopvalues, sizeof(st->lastsent));
+	st->lastSentTime = now;
+	st->suppressed = 0;
+}
+
+/***************/
+/* SENDROLLING */
+/***************/
+void sendRolling(void) {
+// davis rolling field window mean min max ... in console units
+	char buf[400];
+	int i, j, n;
+	n = sprintf(buf, "davis rolling");
+	for (i = 0; i < ROLLFIELDS; i++) {
+		if (rollCount(&st->rolls[i][0]) == 0) continue;
+		n += sprintf(buf + n, " %s", loopfields[rollfield[i]].name);
+		for (j = 0; j < ROLLWINDOWS; j++)
+			n += sprintf(buf + n, " %d %d %d %d", rollwindow[j], 
+						 rollMean(&st->rolls[i][j]), rollMin(&st->rolls[i][j]), rollMax(&st->rolls[i][j]));
+	}
+	sendText(buf);
+}
+
+/***************/
+/* LOOPCHANGED */
+/***************/
+int loopChanged(void) {
+// With -D, a packet is only sent when some field has moved by at least
+// its deadband since the last one sent, or maxSilence has expired.
+	int i, diff;
+	if (maxSilence == 0 || time(NULL) - st->lastSentTime >= maxSilence)
+		return 1;
+	for (i = 0; i < LF_NUM; i++) {
+		if (st->loopvalues[i] == LOOPABSENT) continue;
+		diff = abs(st->loopvalues[i] - st->lastsent[i]);
+		if (i == LF_WINDDIR && diff > 180)
+			diff = 360 - diff;		// 359 to 1 is 2 degrees
+		if (diff && diff >= deadband[i]) {
+			DEBUG2 fprintf(stderr, "Realtime: %s changed by %d\n", loopfields[i].name, diff);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/****************/
+/* SENDREALTIME */
+/****************/
+void sendRealtime(unsigned char * packet) {
+// Forward the 97 data bytes of a validated LOOP packet (CRC not sent)
+	sendBinary("davis realtime", packet, 97);
+	DEBUG dumphex(99, packet);
+}
+
+/***************/
+/* SENDHISTORY */
+/***************/
+void sendHistory(time_t since, int max) {
+// Send up to max stored records from time since as davis history:
+// 4 byte time (network order) then the 97 LOOP bytes
+	unsigned char buf[4 + 97];
+	unsigned int t;
+	int i, n;
+	if (!st->storeOpen) {
+		logmsg(INFO, "INFO " PROGNAME " No store - start with -T file");
+		return;
+	}
+	n = storeCount(&st->store);
+	for (i = storeFind(&st->store, since); i < n && max-- > 0; i++) {
+		struct storerec * r = storeGet(&st->store, i);
+		t = htonl(r->time);
+		memcpy(buf, &t, 4);
+		memcpy(buf + 4, r->loop, 97);
+		sendBinary("davis history", buf, sizeof(buf));
+	}
+}
+
+/**************/
+/* SENDBINARY */
+/**************/
+void sendBinary(char * tag, unsigned char * data, int len) {
+// Pass tag (including its trailing \0) followed by len bytes of data
+// to the publisher, which queues it until the server has it.
+	unsigned char msg[QUEUESLOTSIZE];
+	int taglen = stationTag(tag, (char *)msg + 2) + 1;
+	short length = htons(taglen + len);	// realtime: 15 + 97 = 112
+	int num = 2 + taglen + len;
+	memcpy(msg, &length, 2);
+	memcpy(msg + 2 + taglen, data, len);
+	if (spscPut(&pub, P_QUEUED, msg, num))
+		DEBUG fprintf(stderr, "%s: publisher full - dropped (%d)\n", tag, pub.dropped);
+}
+
+/************/
+/* SENDTEXT */
+/************/
+void sendText(char * msg) {
+// As sockSend, but by way of the publisher.  Not queued if the server is down.
+	char buf[SPSCSLOTSIZE];
+	if (spscPut(&pub, P_TEXT, buf, stationTag(msg, buf) + 1))
+		DEBUG fprintf(stderr, "Text: publisher full - dropped (%d)\n", pub.dropped);
+}
+
+/**************/
+/* STATIONTAG */
+/**************/
+int stationTag(const char * msg, char * out) {
+// Copy msg to out.  With more than one station, a message that starts
+// "davis " is from "davis.N " where N is the station's controller number.
+	if (nstations > 1 && strncmp(msg, LOGON " ", sizeof(LOGON)) == 0)
+		return sprintf(out, LOGON ".%d%s", st->controllernum, msg + sizeof(LOGON) - 1);
+	strcpy(out, msg);
+	return strlen(out);
+}
+
+/************/
+/* LOGEVENT */
+/************/
+void logEvent(int severity, const char * msg) {
+// logmsg hook, called from logDrain.  That is normally the publisher,
+// which adds the event to its batch.  If a FATAL on the acquisition thread
+// has to drain the log itself, the events still go through pub, and the
+// FATAL waits for the publisher to write them before the program ends.
+// The publisher writes a FATAL at once, behind whatever sendq holds, 
+// giving a stalled server up to LOGFATALWAIT to take it.
+	int mine = pthread_equal(pthread_self(), publisher), waited;
+	if (!mine) {
+		sendText((char *)msg);
+		for (waited = 0; severity == FATAL && waited < LOGFATALWAIT 
+			&& (spscLen(&pub) || serverStalled); waited += 10)
+			usleep(10000);
+		return;
+	}
+	if (outText(&out, msg, 1) < 0) {
+		publishFlush();		// no room
+		outText(&out, msg, 1);
+	}
+	for (waited = 0; severity == FATAL; waited += 10) {
+		publishFlush();
+		if (!serverStalled || waited >= LOGFATALWAIT) break;
+		usleep(10000);
+	}
+}
+
+/***************/
+/* PUBLISHLOOP */
+/***************/
+void * publishLoop(void * arg) {
+// The publisher thread.  Drains pub to the server, keeps the disk queue,
+// and reconnects after a failure.  However long a write takes, the
+// acquisition thread keeps reading the console.  Whatever has arrived
+// since the last time round - up to a full batch - goes in one writev.
+	struct spscslot * s;
+	int eof;
+	(void)arg;
+	while (publishing || spscLen(&pub)) {
+		if (serverStalled && sockfd[0] > 0)
+			spscWaitOut(&pub, 1000, sockfd[0]);	// or until the server takes more
+		else
+			spscWait(&pub, 1000);
+		if ((eof = serverEOF)) {		// unless it is one already handed back
+			if (eof == sockfd[0]) lostServer();
+			__sync_bool_compare_and_swap(&serverEOF, eof, 0);
+		}
+		while (!outFull(&out) && (s = spscPeekAt(&pub, pubHeld))) {
+			publishMessage(s);
+			pubHeld++;
+		}
+		logRepeats();		// summaries of suppressed messages
+		logDrain();			// messages logged by either thread since
+		serverTick();
+		publishFlush();
+	}
+	return NULL;
+}
+
+/******************/
+/* PUBLISHMESSAGE */
+/******************/
+void publishMessage(struct spscslot * s) {
+// Add the message in s to the batch.  The slot is held until publishFlush.
+	int i;
+	if (s->tag == P_TEXT) {
+		if (sockfd[0] > 0) outText(&out, (char *)s->msg, 0);
+		return;
+	}
+	if (queueHeld && queueLen(&queue) == (int)queue.hdr->slots)
+		publishFlush();		// queuePut is about to drop a message the batch holds
+	// If the server is down the message waits in the queue.  So it does if the
+	// server is stalled, unless it is realtime and -B says fresh data matters more.
+	if (queueName && (sockfd[0] <= 0 || (serverStalled && spillMessage(s->msg, s->len)))
+		&& queuePut(&queue, s->msg, s->len) == 0) {
+		if (serverStalled && realtimeMessage(s->msg, s->len))
+			sendq.spilled++;
+		return;
+	}
+	// Otherwise it goes ahead of any backlog, and publishFlush queues it if
+	// the write fails.  One backlog message follows it.
+	if (sockfd[0] > 0 && (i = outAdd(&out, s->msg, s->len, 0)) >= 0) {
+		requeue[i] = queueName != NULL;
+		if (!serverStalled) batchQueue(QUEUEBURST);
+	}
+	DEBUG fprintf(stderr, "%s: batched %d bytes\n", s->msg + 2, s->len);
+}
+
+/****************/
+/* PUBLISHFLUSH */
+/****************/
+void publishFlush(void) {
+// Write the batch, after anything still waiting in sendq.  What the socket
+// won't take joins sendq - except queued messages, which stay queued, and
+// live ones that spillMessage says go to the queue.  Then release the pub
+// slots the batch held, and remove queued messages that were written or
+// are now in sendq.  If the write failed, live messages that should have
+// been queued are queued now.
+	static time_t warned = 0;	// when sendq last passed SENDQHIGH
+	unsigned char msg[SENDQSLOTSIZE];
+	struct spscslot * s;
+	int i, j, len, result = 0;
+	char buffer[120];
+	struct pollfd p;
+	if (sockfd[0] > 0 && sqLen(&sendq) && sqWrite(&sendq, sockfd[0]) < 0)
+		result = -1;
+	else if (sockfd[0] > 0 && out.messages)
+		result = sqLen(&sendq) ? 1 : outFlush(&out, sockfd[0]);	// nothing overtakes sendq
+	else if (sockfd[0] > 0 && serverStalled) {		// nothing to write: would it go now?
+		p.fd = sockfd[0];
+		p.events = POLLOUT;
+		result = poll(&p, 1, 0) > 0 ? 0 : 1;
+	}
+	for (i = out.written, j = 0; result == 1 && i < out.messages; i++) {
+		while (j < queueHeld && queueIndex[j] < i) j++;
+		if (j < queueHeld && queueIndex[j] == i && !(i == out.written && out.partial))
+			continue;			// a queued message not started - it stays queued
+		len = outCopy(&out, i, msg);
+		if (i == out.written && out.partial)		// the rest of it must follow, whatever the policy
+			sqPut(&sendq, msg, len, 0);
+		else if (!requeue[i] || !spillMessage(msg, len))
+			sqPut(&sendq, msg, len, realtimeMessage(msg, len));
+	}
+	if ((result == 1 || sqLen(&sendq)) && !serverStalled) sendq.stalls++;
+	serverStalled = result == 1 || sqLen(&sendq);
+	for (i = 0; i < queueHeld && (queueIndex[i] < out.written 
+		|| (result == 1 && queueIndex[i] == out.written && out.partial)); i++)
+		queueDone(&queue);
+	DEBUG2 if (queueHeld) fprintf(stderr, "Queue: sent %d, %d waiting\n", i, queueLen(&queue));
+	queueHeld = 0;
+	for (i = out.written; (result != 0 || sockfd[0] <= 0) && i < out.messages; i++)
+		if (requeue[i] && !(i == out.written && out.partial)) {
+			len = outCopy(&out, i, msg);
+			if (result == 1 && !spillMessage(msg, len)) continue;	// in sendq
+			queuePut(&queue, msg, len);
+			if (result == 1 && realtimeMessage(msg, len)) sendq.spilled++;
+		}
+	memset(requeue, 0, out.messages);
+	outReset(&out);
+	for (; pubHeld; pubHeld--) {
+		s = spscPeek(&pub);
+		if (s->mark) traceMark(&trace, s->mark, TR_WRITTEN);
+		spscDone(&pub);
+	}
+	if (sqLen(&sendq) >= sendq.high && time(NULL) - warned >= STALLWARN) {
+		warned = time(NULL);
+		sprintf(buffer, "WARN " PROGNAME " %d server stalled with %d messages waiting - realtime %s", 
+			controllernum, sqLen(&sendq), policyNames[sendq.policy]);
+		logmsg(WARN, buffer);
+	}
+	if (result < 0) lostServer();
+}
+
+/*******************/
+/* REALTIMEMESSAGE */
+/*******************/
+int realtimeMessage(const unsigned char * msg, int len) {
+// A framed message is a realtime packet if its tag ends " realtime"
+	const unsigned char * end = memchr(msg + 2, '\0', len - 2);
+	return end && end - (msg + 2) >= 9 && memcmp(end - 9, " realtime", 9) == 0;
+}
+
+/****************/
+/* SPILLMESSAGE */
+/****************/
+int spillMessage(const unsigned char * msg, int len) {
+// While the server is stalled, -B decides only what happens to realtime.
+// Anything else is worth keeping, so it goes to the queue like the rest
+// of the backlog rather than into sendq, where it could be dropped.
+	return sendq.policy == SQ_SPILL || !realtimeMessage(msg, len);
+}
+
+/****************/
+/* SERVEROPENED */
+/****************/
+void serverOpened(void) {
+// Writes to the server must never wait: publishFlush keeps what it won't take
+	int flags;
+	if (noserver || sockfd[0] <= 0) return;
+	if ((flags = fcntl(sockfd[0], F_GETFL)) < 0 || fcntl(sockfd[0], F_SETFL, flags | O_NONBLOCK) < 0)
+		DEBUG fprintf(stderr, "Can't make server socket non-blocking: %s\n", strerror(errno));
+}
+
+/*****************/
+/* SERVERHANDOFF */
+/*****************/
+int serverHandoff(int server) {
+// Acquisition thread: take the sockets the publisher has passed over.  A new
+// one replaces server.  One it has finished with is closed here, where 
+// nothing is polling it, so its number can't be reused under the poll.
+	int fd[16], i, n;
+	while ((n = read(handoff[0], fd, sizeof(fd))) > 0)
+		for (i = 0; i < n / (int)sizeof(int); i++)
+			if (fd[i] > 0) {
+				server = fd[i];
+				sockhave = 0;	// a partial message from an old connection is no use
+			} else {
+				__sync_bool_compare_and_swap(&serverEOF, -fd[i], 0);
+				close(-fd[i]);
+				if (server == -fd[i]) server = 0;
+			}
+	return server;
+}
+
+/**************/
+/* BATCHQUEUE */
+/**************/
+int batchQueue(int max) {
+// Add up to max queued messages, oldest first, to the batch.  A message 
+// stays queued until it has been completely written.  Returns the number added.
+	unsigned char * msg;
+	int len, i, added = 0;
+	while (added < max && sockfd[0] > 0 && !serverStalled && queueHeld < OUTMESSAGES 
+		&& (msg = queuePeekAt(&queue, queueHeld, &len))) {
+		if ((i = outAdd(&out, msg, len, 0)) < 0) break;
+		queueIndex[queueHeld++] = i;
+		added++;
+	}
+	return added;
+}
+
+/**************/
+/* LOSTSERVER */
+/**************/
+void lostServer(void) {
+// Stop using the server socket, and hand it to the acquisition thread to
+// close.  serverTick() will reconnect.
+	int fd;
+	if (noserver || sockfd[0] <= 0) return;
+	fd = -sockfd[0];
+	write(handoff[1], &fd, sizeof(fd));
+	sockfd[0] = 0;
+	sqClear(&sendq);		// a message cut short is no use to a new connection
+	serverStalled = 0;
+	logmsg(WARN, "WARN " PROGNAME " lost connection to server - queueing messages");
+}
+
+/**************/
+/* SERVERTICK */
+/**************/
+void serverTick(void) {
+// Called every time round the publisher loop.  Try to reconnect to a lost 
+// server every RECONNECTINTERVAL, and replay any backlog at REPLAYRATE.
+	static time_t nextTry = 0;
+	static time_t lastReplay = 0;
+	char buffer[100];
+	time_t now = time(NULL);
+	if (!noserver && sockfd[0] <= 0 && now >= nextTry) {
+		nextTry = now + RECONNECTINTERVAL;
+		if (reconnectSocket(LOGON, REVISION, "") == 0) {
+			serverOpened();
+			write(handoff[1], &sockfd[0], sizeof(int));
+			sprintf(buffer, "INFO " PROGNAME " %d reconnected to server, replaying %d messages", 
+				controllernum, queueName ? queueLen(&queue) : 0);
+			logmsg(INFO, buffer);
+		}
+	}
+	if (queueName && queueLen(&queue) && now != lastReplay) {
+		lastReplay = now;
+		batchQueue(REPLAYRATE);
+	}
+}
+
+/***************/
+/* REPLYHILOWS */
+/***************/
+void replyHilows(void) {
+	char buffer[300];
+	formatHilows(&st->hilows, buffer, sizeof(buffer));
+	sendText(buffer);
+}
+
+/*************/
+/* EEREQUEST */
+/*************/
+void eeRequest(int flags) {
+// Make sure eeconfig is current, then report it as flags ask.  If nothing
+// is cached read just the configuration block (or the whole image for
+// J_DUMP), otherwise first check whether the console has been reconfigured.
+	if (!st->eevalid)
+		jobAdd((flags & J_DUMP) ? J_GETEE : J_EECONFIG, flags, 0);
+	else if ((flags & J_DUMP) && st->eevalid != 2)		// need the whole image
+		jobAdd(J_GETEE, flags, 0);
+	else
+		jobAdd(J_EESIG, flags, 0);
+}
+
+/************/
+/* EEREPORT */
+/************/
+void eeReport(int flags) {
+	char buffer[300];
+	if (flags & J_DUMP) {
+		dumphex(EESIZE, st->eeimage);
+		logmsg(INFO, "INFO " PROGNAME " written file " DUMPFILE);
+	}
+	if (flags & J_REPLY) {
+		formatEeprom(&st->eeconfig, buffer, sizeof(buffer));
+		sendText(buffer);
+	}
+	if (flags & J_LOG) {
+		sprintf(buffer, "INFO " PROGNAME " %d archive interval %d minutes units 0x%02x",
+			st->controllernum, st->eeconfig.archiveperiod, st->eeconfig.unitbits);
+		logmsg(INFO, buffer);
+	}
+}
+
+/***********/
+/* DMPSTEP */
+/***********/
+int dmpStep(int result) {
+// Fetch archive records newer than the last one sent, using DMPAFT.
+// Each page is ACKed as soon as its CRC passes so the console sends the
+// next page while this one is forwarded.  A bad page is NAKed for a resend.
+// The date and time of the last record forwarded is saved in ARCHIVEFILE
+// after every page, so an interrupted download resumes where it stopped.
+// That is also how a scheduled LOOP gets in: the download is cancelled
+// between pages and queued again behind it.  Return 1 when finished.
+	unsigned char stamp[6];
+	unsigned int recdate, rectime;
+	unsigned short crc;
+	char buffer[128];
+	FILE * f;
+	int i;
+
+	switch (st->step) {
+	case D_ACK:
+		if (result <= 0) {
+			stationWarn("no response to DMPAFT");
+			return 1;
+		}
+		// Davis date stamp then time stamp, LSB first, then CRC MSB first
+		stamp[0] = (st->last >> 16) & 0xFF; stamp[1] = st->last >> 24;
+		stamp[2] = st->last & 0xFF; stamp[3] = (st->last >> 8) & 0xFF;
+		crc = crcUpdate(0, stamp, 4);
+		stamp[4] = crc >> 8; stamp[5] = crc & 0xFF;
+		write(st->commfd, stamp, 6);
+		st->step = D_HEADER;
+		expect(FRAME_ACK, 6, 2000);		// pages, first record, CRC
+		return 0;
+	case D_HEADER:
+		if (result <= 0) {
+			stationWarn("no page count in reply to DMPAFT");
+			return 1;
+		}
+		st->pages = makeshort(data.buf[0], data.buf[1]);
+		st->first = makeshort(data.buf[2], data.buf[3]);
+		DEBUG fprintf(stderr, "DMPAFT %d pages first record %d\n", st->pages, st->first);
+		if (st->pages == 0) {
+			sendByte(ESC);
+			return 1;
+		}
+		st->page = 0;
+		st->tries = PAGERETRIES;
+		st->step = D_PAGE;
+		sendByte(ACK);		// start sending pages
+		expect(FRAME_RAW, PAGESIZE, 2000);
+		return 0;
+	}
+	// D_PAGE
+	if (result <= 0) {
+		DEBUG fprintf(stderr, "DMPAFT page %d %s - NAK\n", st->page, result ? "CRC error" : "timeout");
+		if (--st->tries > 0) {
+			frameReset(&st->framer);	// the resend starts afresh
+			sendByte(NAK);
+			expect(FRAME_RAW, PAGESIZE, 2000);
+			return 0;
+		}
+		sendByte(ESC);
+		sprintf(buffer, "WARN " PROGNAME " archive download abandoned at page %d of %d", st->page, st->pages);
+		logmsg(WARN, buffer);
+		return 1;
+	}
+	st->tries = PAGERETRIES;
+	sendByte(ACK);		// pipeline: request the next page before forwarding this one
+	for (i = (st->page == 0) ? st->first : 0; i < 5; i++) {
+		unsigned char * rec = data.buf + 1 + i * RECORDSIZE;
+		recdate = makeshort(rec[0], rec[1]);
+		rectime = makeshort(rec[2], rec[3]);
+		if (recdate == 0xFFFF || ((recdate << 16) | rectime) <= st->last) {	// empty or wrapped to old data
+			st->done = 1;
+			break;
+		}
+		sendBinary("davis archive", rec, RECORDSIZE);
+		st->last = (recdate << 16) | rectime;
+		st->sent++;
+	}
+	if ((f = fopen(st->archiveName, "w"))) {
+		fprintf(f, "%u %u\n", st->last >> 16, st->last & 0xFFFF);
+		fclose(f);
+	}
+	if (++st->page >= st->pages) return 1;
+	if (st->done) {		// stopped early - cancel the rest
+		sendByte(ESC);
+		return 1;
+	}
+	if (jobWaiting(J_LOOP)) {
+		DEBUG fprintf(stderr, "DMPAFT paused at page %d for LOOP\n", st->page);
+		sendByte(ESC);
+		jobAdd(J_DMPAFT, st->job[0].flags, 0);
+		return 1;
+	}
+	expect(FRAME_RAW, PAGESIZE, 2000);
+	return 0;
+}
+
+/***************/
+/* STATIONWARN */
+/***************/
+void stationWarn(char * msg) {
+	char buffer[200];
+	sprintf(buffer, "WARN " PROGNAME " %d %s", st->controllernum, msg);
+	logmsg(WARN, buffer);
+}
+
+/**********/
+/* REOPEN */
+/**********/
+void reopen(void) {
+// Close the serial port.  serialTick reopens it after REOPENDELAY, and
+// restarts the job that was running.
+	st->loopsLeft = 0;
+	st->awakeUntil = 0;
+	st->metrics.counter[M_REOPEN]++;
+	close(st->commfd);
+	st->commfd = -1;
+	st->vmin = 0;
+	st->state = S_IDLE;
+	st->reopenTime = time(NULL) + REOPENDELAY;
+}
+
+/***************/
+/* STATSFORMAT */
+/***************/
+int statsFormat(char * buf, int size) {
+// One line for the current station.  CRC failures and bytes skipped 
+// looking for an ACK are counted by the framer.
+	int len;
+	st->metrics.counter[M_CRC] = st->framer.crcfails;
+	st->metrics.counter[M_NOACK] = st->framer.noack;
+	len = metricsFormat(&st->metrics, buf, size);
+	len += snprintf(buf + len, size - len, " discarded %d writes %u sent %u stalls %u dropped %u coalesced %u spilled %u", 
+		st->framer.discarded, out.flushes, out.sent, sendq.stalls, sendq.dropped, sendq.coalesced, sendq.spilled);
+	return len < size ? len : size - 1;
+}
+
+/**************/
+/* STATSWRITE */
+/**************/
+void statsWrite(void) {
+// Every STATSINTERVAL replace statsName with the metrics in full
+	char extra[200];
+	st->metrics.counter[M_CRC] = st->framer.crcfails;
+	st->metrics.counter[M_NOACK] = st->framer.noack;
+	sprintf(extra, "discarded %d\nwrites %u sent %u\nsendq %d stalls %u dropped %u coalesced %u spilled %u overflow %u", 
+		st->framer.discarded, out.flushes, out.sent, sqLen(&sendq), sendq.stalls, sendq.dropped, 
+		sendq.coalesced, sendq.spilled, sendq.overflow);
+	if (metricsWrite(&st->metrics, st->statsName, extra))
+		DEBUG fprintf(stderr, "Can't write %s: %s\n", st->statsName, strerror(errno));
+}
+
+/****************/
+/* SERIALOPENED */
+/****************/
+void serialOpened(void) {
+// With -P ask for low latency UART handling.  A port that isn't a tty
+// (a xuart or a hostname:port) stays on ordinary reads.
+	st->vmin = 0;
+	if (!packetMode) return;
+	if (setSerialFrame(st->commfd, 0, 0) < 0) {
+		DEBUG fprintf(stderr, "Station %d: no packet reads on %s\n", st->controllernum, st->serialName);
+		st->vmin = -1;
+		return;
+	}
+	if (setLowLatency(st->commfd) < 0)
+		DEBUG fprintf(stderr, "Station %d: low latency not supported - %s\n", st->controllernum, strerror(errno));
+}
+
+/*************/
+/* FRAMEMODE */
+/*************/
+void frameMode(void) {
+// With -P set VMIN to the bytes still needed to complete the frame being
+// waited for, so poll() wakes on the first byte and one read() collects the
+// rest.  VTIME ends the read early if the console stops short.  Only the
+// port's own frame time is spent in read(); other consoles' bytes wait in
+// the kernel.  Left alone when idle: a stray byte costs at most FRAMEGAP.
+	int need;
+	if (!packetMode || st->commfd < 0 || st->vmin < 0) return;
+	switch (st->state) {
+	case S_WAKE:	need = 2; break;
+	case S_STREAM:	need = LOOPSIZE; break;
+	case S_REPLY:
+		need = st->size;
+		if (st->expect == FRAME_ACK) need++;
+		else if (st->expect == FRAME_WAKE) need = 2;
+		break;
+	default: return;
+	}
+	need -= frameAvail(&st->framer);
+	if (need < 1) need = 1;
+	if (need > 255) need = 255;
+	if (need == st->vmin) return;
+	if (setSerialFrame(st->commfd, need, FRAMEGAP) == 0)
+		st->vmin = need;
+	DEBUG3 fprintf(stderr, "VMIN %d ", need);
 }
 
 /**************/
@@ -582,31 +1984,13 @@ time_t t;
 /************/
 int checkCRC(int size, char *msg)
 {
-        int i;
-        int crc = 0;                                  /* zero checksum to start       */
-        for( i = 0; i < size; i++) {
-                crc = (crc_table[(crc >> 8) ^ *msg++] ^ (crc << 8)) & 0xFFFF; /* CCITT std */
-        }
-        return crc;                                    /* if zero, it passed */
+	return crcUpdate(0, (unsigned char *)msg, size);	/* if zero, it passed */
 } 
 
-/***********/
-/* TIMEMOD */
-/***********/
-time_t timeMod(time_t t) {
-// Return a time in the future at modulus t;
-// ie, if t = 3600 (1 hour) the time returned
-// will be the next time on the hour.
-//	time_t now = time(NULL);
-	if (t == 0) t = 600;
-	DEBUG fprintf(stderr,"TimeMod now = %zu delta = %zu result = %ld\n", time(NULL), t, (time(NULL) / t) * t +t);
-	return (time(NULL) / t) * t + t;
-}
-
 /***********/
 /* DUMPHEX */
 /***********/
-void dumphex(int n, char * data) {
+void dumphex(int n, const unsigned char * data) {
 // Dump N bytes from *data as hex to file /tmp/davis.dat
 	int i;
 	char buf[100];
@@ -628,46 +2012,15 @@ void dumphex(int n, char * data) {
 	fclose(f);
 }
 
-#define makeshort(lsb, msb)  ( lsb | (msb << 8))
-#define makelong(lsb, b2, b3, msb) (lsb | (b2 << 8) | (b3 << 16) | (msb << 24))
-
-char * mins2hhmm(int x) {
-	static char res[8];
-	if (x == 0xFFFF) res[0] = '\0';
-	else
-		sprintf(res, "%02d:%02d", x / 100, x % 100);
-	return res;
-}
-
 /***************/
 /* WRITEPACKET */
 /***************/
-void writepacket(unsigned char * data) {
-	// Textual output
+void writepacket(int * values) {
+	// Textual output from the decoded LOOP values
 	char buf[300];
-	char s1[6], s2[6];
-	snprintf(buf, 300, "INFO " PROGNAME " Data %c%c%c0x%02x Hg%.2f Int %.1fF %u%% Ext %.1fF %u%% Wind %u "
-			"Avg %u Dir %u Rain %.2f\" Irr %d Day %.2f\" Mon %.2f\" Yr %.2f\" Alrm %u "
-			"Bat %.2f [%s-%s]", data[0], data[1], data[2], data[3],	// LOO + barotrend
-			(float)(makeshort(data[7], data[8])) / 1000.0,	// Barometer
-			(float)(makeshort(data[9], data[10])) / 10.0, 
-			data[11], //Internal temp & humidity
-			(float)(makeshort(data[12], data[13])) / 10.0, // External Temp
-			data[33], //External humidity
-			data[14], 
-			data[15], 
-			makeshort(data[16], data[17]),
-			(float)(makeshort(data[41], data[42])) / 100.0, // RainRate
-			 makeshort(data[44], data[45]),					// Radiation
-			(float)(makeshort(data[50], data[51])) / 100.0, 
-			(float)(makeshort(data[52], data[53])) / 100.0,  
-			(float)(makeshort(data[54], data[55])) / 100.0,
-			makelong(data[70], data[71], data[72], data[73]),
-			(float)(makeshort(data[87], data[88]) * 300.0 / 51200.0),
-			strcpy(s1, mins2hhmm(makeshort(data[91], data[92]))), 
-			strcpy(s2, mins2hhmm(makeshort(data[93], data[94]))));
+	int n;
+	n = sprintf(buf, "INFO " PROGNAME " Data");
+	formatLoop(values, buf + n, sizeof(buf) - n);
 	DEBUG fprintf(stderr, "Length %zu bytes '%s'\n", strlen(buf), buf);
 	logmsg(INFO, buf);
 }
-
-	
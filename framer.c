@@ -0,0 +1,158 @@
+/*
+ *  framer.c
+ *  Davis
+ *
+ *  Ring buffer framer.  Replaces reading one byte per select() with a bulk
+ *  read of whatever the port has, followed by a scan for a frame header.
+ *  Each candidate is checked with the CCITT CRC; a failure skips one byte
+ *  and scans again so a good frame following noise is still found.
+ *  The CRC of a candidate is updated as bytes land, so the check is
+ *  complete as soon as the last byte of the frame has been read.
+ *
+ * $Revision$
+ */
+
+#include <string.h>	// for memcpy
+#include <unistd.h>	// for read
+
+#include "framer.h"
+#include "ccitt.h"
+
+#define ACK 0x06
+
+/**************/
+/* FRAMERESET */
+/**************/
+void frameReset(struct framer * f) {
+	f->head = f->tail = 0;
+	f->crcdone = -1;
+}
+
+/**************/
+/* FRAMEAVAIL */
+/**************/
+int frameAvail(struct framer * f) {
+	return f->head - f->tail;
+}
+
+/*************/
+/* FRAMEFILL */
+/*************/
+int frameFill(struct framer * f, int fd) {
+	// Read as much as will fit contiguously.  Returns the read() result: 
+	// 0 means end of file (device gone), -1 an error.
+	int space, n;
+	unsigned int pos;
+	space = RINGSIZE - frameAvail(f);
+	if (space == 0) {		// Full of rubbish - drop the oldest half
+		f->discarded += RINGSIZE / 2;
+		f->tail += RINGSIZE / 2;
+		space = RINGSIZE / 2;
+	}
+	pos = f->head & RINGMASK;
+	if (space > RINGSIZE - pos) space = RINGSIZE - pos;	// up to the wrap point
+	n = read(fd, f->ring + pos, space);
+	if (n > 0) f->head += n;
+	return n;
+}
+
+/************/
+/* FRAMEPUT */
+/************/
+void framePut(struct framer * f, const unsigned char * p, int len) {
+	// As frameFill, but from memory: for replaying a capture
+	int space, n;
+	unsigned int pos;
+	while (len > 0) {
+		space = RINGSIZE - frameAvail(f);
+		if (space == 0) {
+			f->discarded += RINGSIZE / 2;
+			f->tail += RINGSIZE / 2;
+			space = RINGSIZE / 2;
+		}
+		pos = f->head & RINGMASK;
+		if (space > RINGSIZE - pos) space = RINGSIZE - pos;
+		n = len < space ? len : space;
+		memcpy(f->ring + pos, p, n);
+		f->head += n;
+		p += n;
+		len -= n;
+	}
+}
+
+/************/
+/* FRAMEGET */
+/************/
+int frameGet(struct framer * f, int type, int size, unsigned char * out) {
+	// Look for a frame of the given type.  For FRAME_LOOP size is the whole
+	// packet including 'LOO' and CRC.  For FRAME_ACK it is the bytes after 
+	// the ACK including CRC.  Returns 1 with the frame in out, or 0 if more 
+	// data is needed.  Bytes that cannot start a frame are discarded.
+	// A FRAME_RAW has no header to resynchronise on, so a CRC failure
+	// discards the frame and returns -1 for the caller to request a resend.
+	int lead = (type == FRAME_ACK) ? 1 : 0;		// bytes of header not returned
+	int have, n;
+	unsigned int i, pos;
+	if (type == FRAME_WAKE) {		// no CRC: just LF CR
+		while (frameAvail(f) >= 2) {
+			if (f->ring[f->tail & RINGMASK] == '\n' && f->ring[(f->tail + 1) & RINGMASK] == '\r') {
+				f->tail += 2;
+				return 1;
+			}
+			f->tail++;
+			f->discarded++;
+		}
+		return 0;
+	}
+	while (frameAvail(f) > 0) {
+		unsigned char c = f->ring[f->tail & RINGMASK];
+		if (type == FRAME_ACK && c != ACK) {
+			f->noack++;
+			goto skip;
+		}
+		if (type == FRAME_LOOP) {
+			if (c != 'L') goto skip;
+			if (frameAvail(f) >= 2 && f->ring[(f->tail + 1) & RINGMASK] != 'O') goto skip;
+			if (frameAvail(f) >= 3 && f->ring[(f->tail + 2) & RINGMASK] != 'O') goto skip;
+		}
+		if (f->cand != f->tail || f->crcdone < 0) {	// new candidate
+			f->cand = f->tail;
+			f->crcdone = 0;
+			f->crc = 0;
+		}
+		have = frameAvail(f) - lead;
+		if (have > size) have = size;
+		while (f->crcdone < have) {		// CRC the new bytes, in two parts if they wrap
+			pos = (f->tail + lead + f->crcdone) & RINGMASK;
+			n = have - f->crcdone;
+			if (n > RINGSIZE - pos) n = RINGSIZE - pos;
+			f->crc = crcUpdate(f->crc, f->ring + pos, n);
+			f->crcdone += n;
+		}
+		if (have < size)
+			return 0;		// plausible header - wait for the rest
+		f->crcdone = -1;
+		if (f->crc == 0) {
+			pos = (f->tail + lead) & RINGMASK;
+			if (pos + size <= RINGSIZE)
+				memcpy(out, f->ring + pos, size);
+			else {		// wraps
+				i = RINGSIZE - pos;
+				memcpy(out, f->ring + pos, i);
+				memcpy(out + i, f->ring, size - i);
+			}
+			f->tail += size + lead;
+			return 1;
+		}
+		f->crcfails++;
+		if (type == FRAME_RAW) {
+			f->tail += size;
+			f->discarded += size;
+			return -1;
+		}
+skip:
+		f->tail++;
+		f->discarded++;
+	}
+	return 0;
+}
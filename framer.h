@@ -0,0 +1,38 @@
+/*
+ *  framer.h
+ *  Davis
+ *
+ *  Ring buffer framer for the Davis serial stream.  Bytes are read in bulk
+ *  into a ring and frames are located by header and validated by CRC, so a
+ *  packet can be recovered from a noisy or misaligned stream.
+ *
+ * $Revision$
+ */
+
+#define RINGSIZE 8192		/* power of 2 and larger than the biggest frame (GETEE = 4099) */
+#define RINGMASK (RINGSIZE - 1)
+
+// Frame types for frameGet
+#define FRAME_LOOP	1		/* 'LOO' header, CRC over whole frame */
+#define FRAME_ACK	2		/* ACK then size bytes ending in CRC. ACK not returned */
+#define FRAME_RAW	3		/* size bytes ending in CRC, no header (DMP pages) */
+#define FRAME_WAKE	4		/* LF CR reply to a wakeup, no CRC. size is ignored */
+
+struct framer {
+	unsigned char ring[RINGSIZE];
+	unsigned int head;		// next byte written. Free-running, use & RINGMASK
+	unsigned int tail;		// next byte to scan
+	int discarded;			// bytes skipped while resynchronising
+	int crcfails;			// candidate frames rejected by CRC
+	int noack;				// bytes skipped where an ACK was expected
+	unsigned int cand;		// ring position the partial CRC belongs to
+	int crcdone;			// bytes of that candidate already in crc
+	unsigned short crc;		// running CRC so a frame is checked as it arrives
+};
+
+void frameReset(struct framer * f);			// discard everything buffered
+int frameFill(struct framer * f, int fd);	// read what's available. Returns read() result
+void framePut(struct framer * f, const unsigned char * p, int len);	// the same from memory
+int frameAvail(struct framer * f);			// number of bytes buffered
+int frameGet(struct framer * f, int type, int size, unsigned char * out);	// 1 if a frame was copied to out
+	// -1 if a FRAME_RAW failed its CRC
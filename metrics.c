@@ -0,0 +1,104 @@
+/*
+ *  metrics.c
+ *  Davis
+ *
+ *  Counters and latency histograms.  See metrics.h.  Histogram buckets 
+ *  are fixed and roughly logarithmic, which is plenty to tell a 50 mSec
+ *  reply from a 2 second one and costs nothing to update.
+ *
+ * $Revision$
+ */
+
+#include <stdio.h>		// for snprintf
+#include <string.h>		// for memset
+#include <time.h>		// for time
+
+#include "metrics.h"
+
+// Upper bound in mSec of each bucket; the last takes everything longer
+static const int histBounds[HISTBUCKETS] = {10, 20, 50, 100, 200, 500, 1000, 2000, 5000, 0};
+static const char * counterNames[M_COUNTERS] = {"short", "noack", "crc", "reopens", "timeouts", "wakeskips", "wakefails"};
+static const char * histNames[M_HISTOGRAMS] = {"wake", "firstbyte", "frame"};
+
+/****************/
+/* METRICSRESET */
+/****************/
+void metricsReset(struct metrics * m) {
+	memset(m, 0, sizeof(*m));
+	m->since = time(NULL);
+}
+
+/***********/
+/* HISTADD */
+/***********/
+void histAdd(struct histogram * h, int ms) {
+	int i;
+	if (ms < 0) ms = 0;
+	h->count++;
+	h->last = ms;
+	h->total += ms;
+	if (ms > h->max) h->max = ms;
+	for (i = 0; i < HISTBUCKETS - 1; i++)
+		if (ms < histBounds[i]) break;
+	h->bucket[i]++;
+}
+
+/************/
+/* HISTMEAN */
+/************/
+int histMean(struct histogram * h) {
+	return h->count ? (int)(h->total / h->count) : 0;
+}
+
+/******************/
+/* HISTPERCENTILE */
+/******************/
+int histPercentile(struct histogram * h, int pct) {
+	// No more than the maximum seen, which is what the overflow bucket reports
+	int i, n = 0, want = (h->count * pct + 99) / 100;
+	if (h->count == 0) return 0;
+	for (i = 0; i < HISTBUCKETS - 1; i++)
+		if ((n += h->bucket[i]) >= want) return histBounds[i] < h->max ? histBounds[i] : h->max;
+	return h->max;
+}
+
+/*****************/
+/* METRICSFORMAT */
+/*****************/
+int metricsFormat(struct metrics * m, char * buf, int size) {
+	// counters then count mean p50 p95 max for each histogram
+	int i, len = 0;
+	for (i = 0; i < M_COUNTERS && len < size; i++)
+		len += snprintf(buf + len, size - len, "%s%s %d", i ? " " : "", counterNames[i], m->counter[i]);
+	for (i = 0; i < M_HISTOGRAMS && len < size; i++) {
+		struct histogram * h = &m->hist[i];
+		len += snprintf(buf + len, size - len, " %s %d %d %d %d %d", histNames[i], h->count, 
+			histMean(h), histPercentile(h, 50), histPercentile(h, 95), h->max);
+	}
+	return len < size ? len : size - 1;
+}
+
+/****************/
+/* METRICSWRITE */
+/****************/
+int metricsWrite(struct metrics * m, const char * name, const char * extra) {
+	// Replace name with the counters and every histogram bucket, plus a line 
+	// of extra from the caller if not NULL.
+	FILE * f;
+	int i, j;
+	if ((f = fopen(name, "w")) == NULL)
+		return 1;
+	fprintf(f, "since %ld now %ld\n", (long)m->since, (long)time(NULL));
+	for (i = 0; i < M_COUNTERS; i++)
+		fprintf(f, "%s %d\n", counterNames[i], m->counter[i]);
+	if (extra) fprintf(f, "%s\n", extra);
+	for (i = 0; i < M_HISTOGRAMS; i++) {
+		struct histogram * h = &m->hist[i];
+		fprintf(f, "%s count %d last %d mean %d max %d buckets", histNames[i], h->count, h->last, histMean(h), h->max);
+		for (j = 0; j < HISTBUCKETS; j++)
+			if (histBounds[j]) fprintf(f, " <%d:%d", histBounds[j], h->bucket[j]);
+			else fprintf(f, " more:%d", h->bucket[j]);
+		fputc('\n', f);
+	}
+	return fclose(f) != 0;
+}
@@ -0,0 +1,39 @@
+/*
+ *  metrics.h
+ *  Davis
+ *
+ *  Counters and latency histograms for one console, so a degrading cable
+ *  or a slow console shows up in the "stats" reply and the stats file
+ *  rather than only in debug output.
+ *
+ * $Revision$
+ */
+
+#define HISTBUCKETS 10		/* see histBounds in metrics.c */
+
+// Counters
+enum counters { M_SHORT, M_NOACK, M_CRC, M_REOPEN, M_TIMEOUT, M_WAKESKIP, M_WAKEFAIL, M_COUNTERS };
+
+// Histograms, in mSec
+enum histograms { H_WAKE, H_FIRSTBYTE, H_FRAME, M_HISTOGRAMS };
+
+struct histogram {
+	int count;
+	int last;
+	int max;
+	long long total;
+	int bucket[HISTBUCKETS];
+};
+
+struct metrics {
+	time_t since;			// when the counts started
+	int counter[M_COUNTERS];
+	struct histogram hist[M_HISTOGRAMS];
+};
+
+void metricsReset(struct metrics * m);
+void histAdd(struct histogram * h, int ms);
+int histMean(struct histogram * h);
+int histPercentile(struct histogram * h, int pct);	// upper bound of the bucket holding it
+int metricsFormat(struct metrics * m, char * buf, int size);	// one line summary. Returns length
+int metricsWrite(struct metrics * m, const char * name, const char * extra);	// full detail. 0 if ok
@@ -0,0 +1,140 @@
+/*
+ *  outbuf.c
+ *  Davis
+ *
+ *  Batches of MCP messages written with one writev.  See outbuf.h.
+ *  A message added by reference must not change until outFlush returns.
+ *
+ * $Revision$
+ */
+
+#include <string.h>		// for memcpy
+#include <unistd.h>		// for write
+#include <errno.h>		// for EINTR
+#include <arpa/inet.h>	// for htons
+
+#include "outbuf.h"
+
+/***********/
+/* OUTINIT */
+/***********/
+void outInit(struct outbuf * o, int lines) {
+	memset(o, 0, sizeof(*o));
+	o->lines = lines;
+}
+
+/***********/
+/* OUTPART */
+/***********/
+int outPart(struct outbuf * o, const void * data, int len, int copy) {
+	// Append data to the batch. 0 if ok, -1 if there is no room to copy it
+	if (copy) {
+		if (o->copied + len > OUTCOPYSIZE) return -1;
+		memcpy(o->copy + o->copied, data, len);
+		data = o->copy + o->copied;
+		o->copied += len;
+	}
+	o->iov[o->iovs].iov_base = (void *)data;
+	o->iov[o->iovs++].iov_len = len;
+	o->len += len;
+	return 0;
+}
+
+/**********/
+/* OUTADD */
+/**********/
+int outAdd(struct outbuf * o, const void * msg, int len, int copy) {
+	if (o->messages == OUTMESSAGES || outPart(o, msg, len, copy)) return -1;
+	o->end[o->messages] = o->len;
+	return o->messages++;
+}
+
+/***********/
+/* OUTTEXT */
+/***********/
+int outText(struct outbuf * o, const char * text, int copy) {
+	int len = strlen(text);
+	if (o->messages == OUTMESSAGES || (copy && o->copied + len + 1 > OUTCOPYSIZE)) return -1;
+	if (o->lines) {
+		outPart(o, text, len, copy);
+		outPart(o, "\n", 1, 0);
+	} else {
+		o->length[o->messages] = htons(len);
+		outPart(o, &o->length[o->messages], 2, 0);
+		outPart(o, text, len, copy);
+	}
+	o->end[o->messages] = o->len;
+	return o->messages++;
+}
+
+/***********/
+/* OUTFULL */
+/***********/
+int outFull(struct outbuf * o) {
+	return o->messages == OUTMESSAGES || o->len >= OUTFLUSHSIZE || o->copied > OUTCOPYSIZE / 2;
+}
+
+/************/
+/* OUTFLUSH */
+/************/
+int outFlush(struct outbuf * o, int fd) {
+	// Write the batch.  After a short write carry on from where it stopped,
+	// unless fd is non-blocking and full.  Sets written to the number of 
+	// messages that got through and partial if the next one was started.
+	// Returns 0 if all written, 1 if fd would block, -1 on error.  The batch
+	// is left as it was for outCopy; outReset empties it.
+	struct iovec iov[2 * OUTMESSAGES], * v = iov;
+	int iovs = o->iovs, done = 0, result = 0, i;
+	ssize_t n;
+	memcpy(iov, o->iov, iovs * sizeof(struct iovec));
+	while (iovs) {
+		if ((n = writev(fd, v, iovs)) < 0) {
+			if (errno == EINTR) continue;
+			result = (errno == EAGAIN || errno == EWOULDBLOCK) ? 1 : -1;
+			break;
+		}
+		done += n;
+		while (iovs && n >= (ssize_t)v->iov_len) {
+			n -= v->iov_len;
+			v++;
+			iovs--;
+		}
+		if (iovs) {
+			v->iov_base = (char *)v->iov_base + n;
+			v->iov_len -= n;
+		}
+	}
+	if (o->iovs) o->flushes++;
+	for (i = 0; i < o->messages && o->end[i] <= done; i++)
+		;
+	o->written = i;
+	o->partial = i < o->messages && done > (i ? o->end[i - 1] : 0);
+	o->done = done;
+	o->sent += i;
+	return result;
+}
+
+/***********/
+/* OUTCOPY */
+/***********/
+int outCopy(struct outbuf * o, int i, unsigned char * buf) {
+	// Copy what outFlush did not write of message i to buf.  Returns its length.
+	int from = i ? o->end[i - 1] : 0, to = o->end[i], pos = 0, len = 0, n, skip, v;
+	if (from < o->done) from = o->done;
+	for (v = 0; v < o->iovs && pos < to; pos += o->iov[v++].iov_len) {
+		if (pos + (int)o->iov[v].iov_len <= from) continue;
+		skip = from > pos ? from - pos : 0;
+		n = o->iov[v].iov_len - skip;
+		if (pos + skip + n > to) n = to - pos - skip;
+		memcpy(buf + len, (char *)o->iov[v].iov_base + skip, n);
+		len += n;
+	}
+	return len;
+}
+
+/************/
+/* OUTRESET */
+/************/
+void outReset(struct outbuf * o) {
+	o->iovs = o->messages = o->len = o->copied = o->written = o->partial = o->done = 0;
+}
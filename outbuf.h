@@ -0,0 +1,43 @@
+/*
+ *  outbuf.h
+ *  Davis
+ *
+ *  Outbound batch of MCP messages.  Messages are gathered as they come -
+ *  by reference where the caller keeps them until the flush, otherwise
+ *  copied - and the whole batch goes to the server in one writev.  If the
+ *  socket is non-blocking and fills up, what was not written can be copied
+ *  out to wait in a sendq.
+ *
+ * $Revision$
+ */
+
+#include <sys/uio.h>		// for struct iovec
+
+#define OUTMESSAGES 64		/* messages in a batch */
+#define OUTCOPYSIZE 4096	/* bytes of copied messages in a batch */
+#define OUTFLUSHSIZE 4096	/* flush once a batch is this long */
+
+struct outbuf {
+	struct iovec iov[2 * OUTMESSAGES];	// length word and message
+	int iovs;
+	int messages;
+	int len;				// bytes in the batch
+	int lines;				// 1: text is written as a line without a length (-s)
+	unsigned short length[OUTMESSAGES];	// length words, network order
+	int end[OUTMESSAGES];	// offset just after each message
+	char copy[OUTCOPYSIZE];
+	int copied;
+	int written;			// complete messages written by the last flush
+	int partial;			// 1 if it also wrote the start of the next
+	int done;				// bytes it wrote
+	unsigned int flushes;	// writev calls
+	unsigned int sent;		// messages in them
+};
+
+void outInit(struct outbuf * o, int lines);
+int outAdd(struct outbuf * o, const void * msg, int len, int copy);	// framed message. Its index, or -1 if full
+int outText(struct outbuf * o, const char * text, int copy);	// adds the length word. Index, or -1 if full
+int outFull(struct outbuf * o);		// 1 if time to flush
+int outFlush(struct outbuf * o, int fd);	// writev. 0 = all written, 1 = would block, -1 = failed
+int outCopy(struct outbuf * o, int i, unsigned char * buf);	// unwritten part of message i. Returns length
+void outReset(struct outbuf * o);	// empty the batch after outFlush
@@ -0,0 +1,116 @@
+/*
+ *  queue.c
+ *  Davis
+ *
+ *  Disk-backed message queue.  See queue.h.  The file is flushed
+ *  asynchronously, so the queue survives a restart of the program and, 
+ *  short of a power failure, of the board.
+ *
+ * $Revision$
+ */
+
+#include <stdio.h>		// for NULL
+#include <string.h>		// for memcpy
+#include <fcntl.h>		// for O_RDWR
+#include <unistd.h>		// for ftruncate
+#include <sys/mman.h>	// for mmap
+#include <sys/stat.h>	// for fstat
+
+#include "queue.h"
+
+#define SLOT(q, n) ((q)->slots + ((n) % (q)->hdr->slots) * QUEUESLOTSIZE)
+
+/*************/
+/* QUEUEOPEN */
+/*************/
+int queueOpen(struct queue * q, const char * name, int slots) {
+	// Open or create the queue file, keeping anything still queued
+	struct stat st;
+	size_t size = QUEUEHDRSIZE + (size_t)slots * QUEUESLOTSIZE;
+	
+	if ((q->fd = open(name, O_RDWR | O_CREAT, 0644)) < 0)
+		return -1;
+	if (fstat(q->fd, &st) < 0 || st.st_size != size) {
+		if (ftruncate(q->fd, 0) < 0 || ftruncate(q->fd, size) < 0) {
+			close(q->fd);
+			return -1;
+		}
+	}
+	q->hdr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, q->fd, 0);
+	if (q->hdr == MAP_FAILED) {
+		close(q->fd);
+		return -1;
+	}
+	q->slots = (unsigned char *)q->hdr + QUEUEHDRSIZE;
+	if (memcmp(q->hdr->magic, QUEUEMAGIC, 8) || q->hdr->slotsize != QUEUESLOTSIZE 
+		|| q->hdr->slots != slots || q->hdr->head - q->hdr->tail > slots) {
+		memset(q->hdr, 0, QUEUEHDRSIZE);
+		memcpy(q->hdr->magic, QUEUEMAGIC, 8);
+		q->hdr->slotsize = QUEUESLOTSIZE;
+		q->hdr->slots = slots;
+	}
+	return 0;
+}
+
+/************/
+/* QUEUEPUT */
+/************/
+int queuePut(struct queue * q, const unsigned char * msg, int len) {
+	unsigned char * slot;
+	if (len > QUEUESLOTSIZE - 2) return 1;
+	if (queueLen(q) == q->hdr->slots) {		// full - lose the oldest
+		q->hdr->tail++;
+		q->hdr->dropped++;
+	}
+	slot = SLOT(q, q->hdr->head);
+	slot[0] = len & 0xFF;
+	slot[1] = len >> 8;
+	memcpy(slot + 2, msg, len);
+	q->hdr->head++;
+	msync(q->hdr, QUEUEHDRSIZE, MS_ASYNC);
+	return 0;
+}
+
+/************/
+/* QUEUELEN */
+/************/
+int queueLen(struct queue * q) {
+	return q->hdr->head - q->hdr->tail;
+}
+
+/*************/
+/* QUEUEPEEK */
+/*************/
+unsigned char * queuePeek(struct queue * q, int * len) {
+	return queuePeekAt(q, 0, len);
+}
+
+/***************/
+/* QUEUEPEEKAT */
+/***************/
+unsigned char * queuePeekAt(struct queue * q, int n, int * len) {
+	unsigned char * slot;
+	if (n >= queueLen(q)) return NULL;
+	slot = SLOT(q, q->hdr->tail + n);
+	*len = slot[0] | (slot[1] << 8);
+	return slot + 2;
+}
+
+/*************/
+/* QUEUEDONE */
+/*************/
+void queueDone(struct queue * q) {
+	if (queueLen(q) == 0) return;
+	q->hdr->tail++;
+	q->hdr->sent++;
+}
+
+/**************/
+/* QUEUECLOSE */
+/**************/
+void queueClose(struct queue * q) {
+	size_t size = QUEUEHDRSIZE + (size_t)q->hdr->slots * QUEUESLOTSIZE;
+	msync(q->hdr, size, MS_SYNC);
+	munmap(q->hdr, size);
+	close(q->fd);
+}
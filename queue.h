@@ -0,0 +1,40 @@
+/*
+ *  queue.h
+ *  Davis
+ *
+ *  Disk-backed store-and-forward queue of messages for the MCP.  A memory
+ *  mapped ring of fixed size slots; when full the oldest message is dropped.
+ *  A message is removed once it has been completely written to the server
+ *  socket.  The MCP sends no acknowledgement, so one still in the kernel's
+ *  buffers when the connection drops is lost.
+ *
+ * $Revision$
+ */
+
+#define QUEUEMAGIC "DAVISQ01"
+#define QUEUEHDRSIZE 4096
+#define QUEUESLOTSIZE 256	/* 2 byte length + the message as sent on the socket */
+
+struct queuehdr {
+	char magic[8];
+	unsigned int slotsize;
+	unsigned int slots;
+	unsigned int head;		// next slot to write, free running
+	unsigned int tail;		// oldest not yet written
+	unsigned int dropped;	// lost to overflow
+	unsigned int sent;		// written to the server and removed
+};
+
+struct queue {
+	int fd;
+	struct queuehdr * hdr;
+	unsigned char * slots;
+};
+
+int queueOpen(struct queue * q, const char * name, int slots);	// 0 = ok
+int queuePut(struct queue * q, const unsigned char * msg, int len);	// 0 = ok, 1 = too long
+int queueLen(struct queue * q);
+unsigned char * queuePeek(struct queue * q, int * len);	// oldest, or NULL if empty
+unsigned char * queuePeekAt(struct queue * q, int n, int * len);	// nth oldest, or NULL
+void queueDone(struct queue * q);		// remove the oldest, now it has been written
+void queueClose(struct queue * q);
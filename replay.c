@@ -0,0 +1,160 @@
+/*
+ *  replay.c
+ *  Davis
+ *
+ *  Replay a capture made with davis -C through the framer, CRC check and
+ *  LOOP decoder, at full speed.  Reports frames, CRC failures and bytes
+ *  discarded while resynchronising, and the rate in frames/s and MB/s.
+ *  With -v every frame is printed, so the output for a capture from a
+ *  noisy site can be kept and compared after a change to the framer.
+ *
+ *  Usage: replay [-a size | -r size] [-s station] [-n repeats] [-v] file
+ *  -a: ACK then size bytes (eg 438 for HILOWS)  -r: raw size bytes (DMPAFT
+ *  pages, 267).  Otherwise LOOP packets are looked for.
+ *
+ * $Revision$
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>		// for getopt
+#include <time.h>
+
+#include "framer.h"
+#include "vantage.h"
+#include "capture.h"
+
+#define MAXSTATIONS 8
+
+struct record {
+	int station;
+	int len;
+	unsigned char * data;
+};
+
+struct framer framers[MAXSTATIONS];
+int stationOf[MAXSTATIONS];
+int nstations;
+
+/************/
+/* FRAMEROF */
+/************/
+struct framer * framerOf(int station) {
+	int i;
+	for (i = 0; i < nstations; i++)
+		if (stationOf[i] == station) return &framers[i];
+	if (nstations == MAXSTATIONS) return NULL;
+	stationOf[nstations] = station;
+	frameReset(&framers[nstations]);
+	return &framers[nstations++];
+}
+
+/*******/
+/* NOW */
+/*******/
+double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*********/
+/* USAGE */
+/*********/
+void usage(void) {
+	printf("Usage: replay [-a size | -r size] [-s station] [-n repeats] [-v] capturefile\n");
+	printf("-a: frames are ACK then size bytes  -r: frames are size bytes  (default LOOP packets)\n");
+	printf("-s: only this controller number  -n: passes for timing (default 1)  -v: print each frame\n");
+}
+
+/********/
+/* MAIN */
+/********/
+int main(int argc, char *argv[]) {
+	struct capture cap;
+	struct record * recs = NULL;
+	struct framer * f;
+	unsigned char buf[CAPMAXREAD], out[EESIZE + 2];
+	char text[400];
+	int values[LF_NUM];
+	int option, type = FRAME_LOOP, size = LOOPSIZE, only = -1, repeats = 1, verbose = 0;
+	int nrecs = 0, maxrecs = 0, len, station, r, rep, i, frames = 0, crcfails = 0, discarded = 0;
+	unsigned int delta;
+	double bytes = 0, seconds = 0, t0;
+
+	while ((option = getopt(argc, argv, "a:r:s:n:v")) != -1) {
+		switch (option) {
+		case 'a': type = FRAME_ACK; size = atoi(optarg); break;
+		case 'r': type = FRAME_RAW; size = atoi(optarg); break;
+		case 's': only = atoi(optarg); break;
+		case 'n': repeats = atoi(optarg); break;
+		case 'v': verbose = 1; break;
+		default: usage(); exit(1);
+		}
+	}
+	if (optind != argc - 1 || size <= 0 || size > sizeof(out)) {
+		usage();
+		exit(1);
+	}
+	if (captureReplay(&cap, argv[optind])) {
+		fprintf(stderr, "replay: %s is not a capture file\n", argv[optind]);
+		exit(1);
+	}
+	// Read it all first, so only the parsing is timed
+	while ((len = captureNext(&cap, &delta, &station, buf)) > 0) {
+		if (only >= 0 && station != only) continue;
+		if (nrecs == maxrecs) {
+			maxrecs = maxrecs ? maxrecs * 2 : 1024;
+			if ((recs = realloc(recs, maxrecs * sizeof(struct record))) == NULL) {
+				fprintf(stderr, "replay: out of memory\n");
+				exit(1);
+			}
+		}
+		recs[nrecs].station = station;
+		recs[nrecs].len = len;
+		if ((recs[nrecs].data = malloc(len)) == NULL) {
+			fprintf(stderr, "replay: out of memory\n");
+			exit(1);
+		}
+		memcpy(recs[nrecs++].data, buf, len);
+	}
+	if (len < 0) fprintf(stderr, "replay: capture damaged after %d records\n", cap.records);
+	captureClose(&cap);
+
+	for (rep = 0; rep < repeats; rep++) {
+		nstations = 0;
+		t0 = now();
+		for (i = 0; i < nrecs; i++) {
+			if ((f = framerOf(recs[i].station)) == NULL) continue;
+			framePut(f, recs[i].data, recs[i].len);
+			while ((r = frameGet(f, type, size, out)) != 0) {
+				if (r < 0) continue;		// a raw frame failed its CRC - counted by the framer
+				if (type == FRAME_LOOP) loopDecode(out, values);
+				if (rep) continue;
+				frames++;
+				if (!verbose) continue;
+				if (type == FRAME_LOOP) {
+					formatLoop(values, text, sizeof(text));
+					printf("%d %s %s\n", recs[i].station, loopType(out) ? "LOOP2" : "LOOP", text);
+				} else
+					printf("%d frame %d bytes\n", recs[i].station, size);
+			}
+			if (rep == 0) bytes += recs[i].len;
+		}
+		seconds += now() - t0;
+		if (rep == 0)
+			for (i = 0; i < nstations; i++) {
+				crcfails += framers[i].crcfails;
+				discarded += framers[i].discarded;
+			}
+		for (i = 0; i < nstations; i++)
+			framers[i].crcfails = framers[i].discarded = framers[i].noack = 0;
+	}
+	printf("%d records %.0f bytes: %d frames, %d CRC failures, %d bytes discarded\n",
+		nrecs, bytes, frames, crcfails, discarded);
+	if (seconds > 0)
+		printf("%.0f frames/s %.2f MB/s over %d passes\n", frames * repeats / seconds,
+			bytes * repeats / seconds / 1e6, repeats);
+	return 0;
+}
@@ -0,0 +1,88 @@
+/*
+ *  rolling.c
+ *  Davis
+ *
+ *  Rolling window statistics.  See rolling.h.
+ *
+ * $Revision$
+ */
+
+#include <stdlib.h>	// for malloc
+#include <time.h>	// for time_t
+
+#include "rolling.h"
+
+/************/
+/* ROLLINIT */
+/************/
+int rollInit(struct rolling * r, int window, int cap) {
+	r->window = window;
+	r->cap = cap;
+	r->first = r->next = 0;
+	r->minh = r->mint = r->maxh = r->maxt = 0;
+	r->sum = 0;
+	r->v = malloc(cap * sizeof(int));
+	r->t = malloc(cap * sizeof(time_t));
+	r->minq = malloc(cap * sizeof(unsigned int));
+	r->maxq = malloc(cap * sizeof(unsigned int));
+	return !(r->v && r->t && r->minq && r->maxq);
+}
+
+/************/
+/* ROLLDROP */
+/************/
+static void rollDrop(struct rolling * r) {
+	// Remove the oldest sample
+	r->sum -= r->v[r->first % r->cap];
+	if (r->minh != r->mint && r->minq[r->minh % r->cap] == r->first) r->minh++;
+	if (r->maxh != r->maxt && r->maxq[r->maxh % r->cap] == r->first) r->maxh++;
+	r->first++;
+}
+
+/***********/
+/* ROLLADD */
+/***********/
+void rollAdd(struct rolling * r, time_t now, int value) {
+	int cap = r->cap;
+	while (r->first != r->next && 
+		   (now - r->t[r->first % cap] >= r->window || r->next - r->first == cap))
+		rollDrop(r);
+	r->v[r->next % cap] = value;
+	r->t[r->next % cap] = now;
+	r->sum += value;
+	// Samples that can never again be the minimum (or maximum) leave the deque
+	while (r->mint != r->minh && r->v[r->minq[(r->mint - 1) % cap] % cap] >= value) r->mint--;
+	r->minq[r->mint++ % cap] = r->next;
+	while (r->maxt != r->maxh && r->v[r->maxq[(r->maxt - 1) % cap] % cap] <= value) r->maxt--;
+	r->maxq[r->maxt++ % cap] = r->next;
+	r->next++;
+}
+
+/*************/
+/* ROLLCOUNT */
+/*************/
+int rollCount(struct rolling * r) {
+	return r->next - r->first;
+}
+
+/************/
+/* ROLLMEAN */
+/************/
+int rollMean(struct rolling * r) {
+	int n = rollCount(r);
+	return n ? r->sum / n : 0;
+}
+
+/***********/
+/* ROLLMIN */
+/***********/
+int rollMin(struct rolling * r) {
+	return rollCount(r) ? r->v[r->minq[r->minh % r->cap] % r->cap] : 0;
+}
+
+/***********/
+/* ROLLMAX */
+/***********/
+int rollMax(struct rolling * r) {
+	return rollCount(r) ? r->v[r->maxq[r->maxh % r->cap] % r->cap] : 0;
+}
@@ -0,0 +1,28 @@
+/*
+ *  rolling.h
+ *  Davis
+ *
+ *  Rolling window statistics: mean, minimum and maximum over the last
+ *  window seconds, each updated in O(1) amortised time per sample using
+ *  a running sum and monotonic deques for the extremes.
+ *
+ * $Revision$
+ */
+
+struct rolling {
+	int window;				// seconds
+	int cap;				// most samples held. Oldest are dropped early if exceeded
+	unsigned int first, next;	// sequence numbers of oldest and next sample
+	int * v;				// values, indexed by sequence % cap
+	time_t * t;				// and their times
+	unsigned int * minq, * maxq;	// deques of sequence numbers with increasing / decreasing values
+	unsigned int minh, mint, maxh, maxt;	// deque head and tail, free running
+	long long sum;
+};
+
+int rollInit(struct rolling * r, int window, int cap);	// 0 = ok
+void rollAdd(struct rolling * r, time_t now, int value);
+int rollCount(struct rolling * r);
+int rollMean(struct rolling * r);
+int rollMin(struct rolling * r);
+int rollMax(struct rolling * r);
@@ -0,0 +1,106 @@
+/*
+ *  sched.c
+ *  Davis
+ *
+ *  Periodic tasks.  See sched.h.  Without a timerfd the caller's poll()
+ *  timeout does the same job to the nearest millisecond.
+ *
+ * $Revision$
+ */
+
+#include <time.h>		// for clock_gettime
+#include <unistd.h>		// for read
+#ifdef linux
+#include <sys/timerfd.h>	// for timerfd_create
+#endif
+
+#include "sched.h"
+
+time_t timeMod(time_t interval, int jitter);	// in common.c
+
+/*********/
+/* MSNOW */
+/*********/
+long long msNow(void) {
+// Milliseconds on the monotonic clock, for times unaffected by clock changes
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/**************/
+/* WALLOFFSET */
+/**************/
+static long long wallOffset(void) {
+// Wall-clock mSec minus monotonic mSec
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000 - msNow();
+}
+
+/*************/
+/* TASKSTART */
+/*************/
+void taskStart(struct task * t, int interval, int jitter) {
+	t->interval = interval;
+	t->jitter = jitter;
+	if (interval <= 0) return;
+	t->due = timeMod(interval, jitter) * 1000LL - wallOffset();
+}
+
+/***********/
+/* TASKDUE */
+/***********/
+int taskDue(struct task * t, long long now) {
+	long long err;
+	if (t->interval <= 0 || now < t->due) return 0;
+	t->runs++;
+	t->due += t->interval * 1000LL;
+	if (t->due <= now) {			// held up for a whole period - don't run twice
+		t->missed += (now - t->due) / (t->interval * 1000LL) + 1;
+		taskStart(t, t->interval, t->jitter);
+		return 1;
+	}
+	// Where the wall clock puts the next run, relative to its boundary
+	err = (t->due + wallOffset() - t->jitter * 1000LL) % (t->interval * 1000LL);
+	if (err > t->interval * 500LL) err -= t->interval * 1000LL;
+	if (err > ALIGNSLOP || err < -ALIGNSLOP) {	// clock stepped
+		t->realigned++;
+		taskStart(t, t->interval, t->jitter);
+	}
+	return 1;
+}
+
+/*************/
+/* SCHEDOPEN */
+/*************/
+int schedOpen(void) {
+#ifdef TFD_NONBLOCK
+	return timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+#else
+	return -1;
+#endif
+}
+
+/************/
+/* SCHEDARM */
+/************/
+void schedArm(int fd, long long due) {
+#ifdef TFD_NONBLOCK
+	struct itimerspec its;
+	if (fd < 0) return;
+	if (due < 0) due = 0;		// nothing due: 0 disarms it
+	its.it_interval.tv_sec = its.it_interval.tv_nsec = 0;
+	its.it_value.tv_sec = due / 1000;
+	its.it_value.tv_nsec = (due % 1000) * 1000000;
+	timerfd_settime(fd, TFD_TIMER_ABSTIME, &its, NULL);
+#endif
+}
+
+/************/
+/* SCHEDACK */
+/************/
+void schedAck(int fd) {
+	unsigned long long expirations;
+	read(fd, &expirations, sizeof(expirations));
+}
@@ -0,0 +1,30 @@
+/*
+ *  sched.h
+ *  Davis
+ *
+ *  Periodic tasks on the monotonic clock.  Each task is first aligned to
+ *  a wall-clock boundary with timeMod(), then advanced by whole intervals
+ *  in monotonic time, so it does not drift and is not moved by a slow
+ *  command.  If the wall clock is stepped, or a period is missed, the
+ *  task is realigned.  One timerfd wakes the event loop for the earliest.
+ *
+ * $Revision$
+ */
+
+#define ALIGNSLOP 1000		/* mSec off the wall-clock boundary before realigning */
+
+struct task {
+	int interval;			// seconds. 0 = disabled
+	int jitter;				// seconds after the boundary, as timeMod()
+	long long due;			// msNow() when it next runs
+	int runs;
+	int missed;				// periods skipped because the loop was held up
+	int realigned;			// times the wall clock moved under it
+};
+
+long long msNow(void);		// monotonic milliseconds
+void taskStart(struct task * t, int interval, int jitter);	// due at the next boundary
+int taskDue(struct task * t, long long now);	// 1 if due, and advance to the next period
+int schedOpen(void);		// timerfd, or -1 if there is none
+void schedArm(int fd, long long due);	// wake at msNow() time due. 0 = nothing due
+void schedAck(int fd);		// after the timerfd polls readable
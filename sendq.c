@@ -0,0 +1,153 @@
+/*
+ *  sendq.c
+ *  Davis
+ *
+ *  Send queue for a stalled server socket.  See sendq.h.
+ *  A dropped message stays in its slot with len 0 until the ring is
+ *  compacted or sqWrite passes it.  The oldest message, once partly
+ *  written, is never dropped: the server would lose its framing.
+ *
+ * $Revision$
+ */
+
+#include <string.h>		// for memcpy
+#include <unistd.h>		// for write
+#include <errno.h>		// for EAGAIN
+#include <sys/uio.h>	// for writev
+
+#include "sendq.h"
+
+#define SLOT(q, n) (&(q)->slot[(n) % SENDQSLOTS])
+#define SQIOV 64		/* messages in one writev */
+
+/**********/
+/* SQINIT */
+/**********/
+void sqInit(struct sendq * q, int high, int policy) {
+	memset(q, 0, sizeof(*q));
+	q->high = high;
+	q->policy = policy;
+}
+
+/*********/
+/* SQLEN */
+/*********/
+int sqLen(struct sendq * q) {
+	return q->live;
+}
+
+/*************/
+/* SQCOMPACT */
+/*************/
+void sqCompact(struct sendq * q) {
+	// Close up the slots of dropped messages
+	unsigned int from, to = q->tail;
+	for (from = q->tail; from != q->head; from++) {
+		if (SLOT(q, from)->len == 0) continue;
+		if (from != to) *SLOT(q, to) = *SLOT(q, from);
+		to++;
+	}
+	q->head = to;
+}
+
+/**********/
+/* SQDROP */
+/**********/
+int sqDrop(struct sendq * q, const unsigned char * tag) {
+	// Drop the oldest realtime message, or with tag every one from that 
+	// station.  The one being written is left alone.  Returns the number dropped.
+	struct sendqslot * s;
+	unsigned int n = q->tail;
+	int dropped = 0;
+	if (q->offset) n++;
+	for (; n != q->head; n++) {
+		s = SLOT(q, n);
+		if (s->len == 0 || !s->realtime) continue;
+		if (tag && strcmp((char *)s->msg + 2, (char *)tag)) continue;
+		s->len = 0;
+		q->live--;
+		dropped++;
+		if (!tag) break;
+	}
+	return dropped;
+}
+
+/*********/
+/* SQPUT */
+/*********/
+int sqPut(struct sendq * q, const unsigned char * msg, int len, int realtime) {
+	// Returns 0 if msg is queued, 1 if it was lost
+	struct sendqslot * s;
+	int n;
+	if (len > SENDQSLOTSIZE) return 1;
+	if (realtime && q->policy == SQ_COALESCE && (n = sqDrop(q, msg + 2)))
+		q->coalesced += n;		// replaced by this one
+	else if (realtime && q->live >= q->high) {
+		if (sqDrop(q, NULL))
+			q->dropped++;		// make room for this one
+		else {
+			q->dropped++;		// nothing older to drop
+			return 1;
+		}
+	}
+	if (q->head - q->tail == SENDQSLOTS) sqCompact(q);
+	if (q->head - q->tail == SENDQSLOTS) {
+		q->overflow++;
+		return 1;
+	}
+	s = SLOT(q, q->head++);
+	s->len = len;
+	s->realtime = realtime;
+	memcpy(s->msg, msg, len);
+	q->live++;
+	return 0;
+}
+
+/***********/
+/* SQWRITE */
+/***********/
+int sqWrite(struct sendq * q, int fd) {
+	// Write from the oldest message on until fd would block.
+	struct iovec iov[SQIOV];
+	struct sendqslot * s;
+	unsigned int n;
+	int iovs;
+	ssize_t done;
+	while (q->live) {
+		for (iovs = 0, n = q->tail; n != q->head && iovs < SQIOV; n++) {
+			s = SLOT(q, n);
+			if (s->len == 0) continue;
+			iov[iovs].iov_base = s->msg + (iovs ? 0 : q->offset);
+			iov[iovs].iov_len = s->len - (iovs ? 0 : q->offset);
+			iovs++;
+		}
+		if ((done = writev(fd, iov, iovs)) < 0) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+			return -1;
+		}
+		for (n = q->tail; done && n != q->head; n++) {	// release what was written
+			s = SLOT(q, n);
+			if (s->len == 0) continue;
+			if (done < s->len - q->offset) {
+				q->offset += done;
+				break;
+			}
+			done -= s->len - q->offset;
+			s->len = 0;
+			q->offset = 0;
+			q->live--;
+		}
+		while (q->tail != q->head && SLOT(q, q->tail)->len == 0)
+			q->tail++;
+	}
+	if (q->live == 0) q->tail = q->head;
+	return q->live;
+}
+
+/***********/
+/* SQCLEAR */
+/***********/
+void sqClear(struct sendq * q) {
+	q->head = q->tail = q->live = q->offset = 0;
+}
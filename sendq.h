@@ -0,0 +1,43 @@
+/*
+ *  sendq.h
+ *  Davis
+ *
+ *  Messages waiting for a stalled server socket.  Bounded, with a high
+ *  water mark past which realtime messages give way according to the
+ *  policy: the oldest are dropped, or each station keeps only its latest.
+ *  (The spill policy sends them to the disk queue instead, which is up to
+ *  the caller; here it behaves as drop.)
+ *
+ * $Revision$
+ */
+
+#define SENDQSLOTS 256
+#define SENDQSLOTSIZE 324	/* length word and the longest message in pub */
+
+enum sqpolicy { SQ_DROP, SQ_COALESCE, SQ_SPILL };
+
+struct sendqslot {
+	short len;				// framed message length, 0 once dropped
+	short realtime;
+	unsigned char msg[SENDQSLOTSIZE];
+};
+
+struct sendq {
+	struct sendqslot slot[SENDQSLOTS];
+	unsigned int head, tail;	// free running
+	int live;				// messages not dropped
+	int offset;				// bytes of the oldest already written
+	int high;				// high water mark, messages
+	int policy;
+	unsigned int stalls;	// times the socket filled up
+	unsigned int dropped;	// realtime dropped by SQ_DROP (or SQ_SPILL)
+	unsigned int coalesced;	// realtime replaced by a later one
+	unsigned int spilled;	// realtime sent to disk instead - counted by the caller
+	unsigned int overflow;	// other messages lost because it was full
+};
+
+void sqInit(struct sendq * q, int high, int policy);
+int sqLen(struct sendq * q);			// messages waiting
+int sqPut(struct sendq * q, const unsigned char * msg, int len, int realtime);	// framed message. 0 = queued
+int sqWrite(struct sendq * q, int fd);	// as much as fd takes. Messages left, or -1 on error
+void sqClear(struct sendq * q);
@@ -0,0 +1,133 @@
+/*
+ *  spsc.c
+ *  Davis
+ *
+ *  Single producer, single consumer message ring.  See spsc.h.
+ *  head and tail are free running; each is written by one side only, 
+ *  so no lock is needed - just a barrier between filling (or emptying)
+ *  a slot and publishing the new index.
+ *
+ * $Revision$
+ */
+
+#include <stdlib.h>		// for malloc
+#include <string.h>		// for memcpy
+#include <fcntl.h>		// for O_NONBLOCK
+#include <unistd.h>		// for pipe
+#include <poll.h>		// for poll
+
+#include "spsc.h"
+
+#define barrier() __sync_synchronize()
+
+/************/
+/* SPSCINIT */
+/************/
+int spscInit(struct spsc * r, int slots) {
+	unsigned int n = 1;
+	while (n < (unsigned int)slots) n <<= 1;
+	if ((r->slot = malloc(n * sizeof(struct spscslot))) == NULL)
+		return -1;
+	if (pipe(r->wake) < 0) {
+		free(r->slot);
+		return -1;
+	}
+	fcntl(r->wake[0], F_SETFL, O_NONBLOCK);
+	fcntl(r->wake[1], F_SETFL, O_NONBLOCK);		// never block the producer
+	r->slots = n;
+	r->head = r->tail = r->dropped = r->mark = 0;
+	return 0;
+}
+
+/***********/
+/* SPSCPUT */
+/***********/
+int spscPut(struct spsc * r, int tag, const void * msg, int len) {
+	struct spscslot * s;
+	unsigned int head = r->head;
+	if (len > (int)sizeof(s->msg) || head - r->tail >= r->slots) {
+		r->dropped++;
+		return 1;
+	}
+	s = &r->slot[head & (r->slots - 1)];
+	s->tag = tag;
+	s->len = len;
+	s->mark = r->mark;
+	memcpy(s->msg, msg, len);
+	barrier();			// slot contents before the new head
+	r->head = head + 1;
+	barrier();			// new head before looking at tail
+	if (r->tail == head)		// consumer had emptied the ring - it may be asleep
+		write(r->wake[1], "", 1);
+	return 0;
+}
+
+/************/
+/* SPSCPEEK */
+/************/
+struct spscslot * spscPeek(struct spsc * r) {
+	unsigned int tail = r->tail;
+	if (tail == r->head) return NULL;
+	barrier();			// head before the slot contents
+	return &r->slot[tail & (r->slots - 1)];
+}
+
+/**************/
+/* SPSCPEEKAT */
+/**************/
+struct spscslot * spscPeekAt(struct spsc * r, int n) {
+	// As spscPeek, for the consumer holding several slots at once
+	unsigned int tail = r->tail;
+	if ((unsigned int)n >= r->head - tail) return NULL;
+	barrier();
+	return &r->slot[(tail + n) & (r->slots - 1)];
+}
+
+/************/
+/* SPSCDONE */
+/************/
+void spscDone(struct spsc * r) {
+	barrier();			// finished with the slot before releasing it
+	r->tail++;
+}
+
+/************/
+/* SPSCWAIT */
+/************/
+int spscWait(struct spsc * r, int tmout) {
+	// Return 1 if there is a message, 0 on timeout
+	struct pollfd p;
+	char buf[64];
+	p.fd = r->wake[0];
+	p.events = POLLIN;
+	if (spscLen(r) == 0)
+		poll(&p, 1, tmout);
+	while (read(r->wake[0], buf, sizeof(buf)) > 0)
+		;
+	return spscLen(r) > 0;
+}
+
+/**************/
+/* SPSCWAITOUT */
+/**************/
+int spscWaitOut(struct spsc * r, int tmout, int fd) {
+	// As spscWait, but also return as soon as fd can be written
+	struct pollfd p[2];
+	char buf[64];
+	p[0].fd = r->wake[0];
+	p[0].events = POLLIN;
+	p[1].fd = fd;
+	p[1].events = POLLOUT;
+	if (spscLen(r) == 0)
+		poll(p, 2, tmout);
+	while (read(r->wake[0], buf, sizeof(buf)) > 0)
+		;
+	return spscLen(r) > 0;
+}
+
+/***********/
+/* SPSCLEN */
+/***********/
+int spscLen(struct spsc * r) {
+	return r->head - r->tail;
+}
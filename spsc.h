@@ -0,0 +1,40 @@
+/*
+ *  spsc.h
+ *  Davis
+ *
+ *  Lock-free single producer, single consumer ring of messages between
+ *  the acquisition thread and the publisher thread.  The producer never
+ *  waits: if the ring is full the message is dropped and counted.  The
+ *  consumer sleeps on a pipe that the producer writes to only when the
+ *  consumer may have caught up.
+ *
+ * $Revision$
+ */
+
+#define SPSCSLOTSIZE 320	/* tag, length and a message - longest is a text reply */
+
+struct spscslot {
+	short tag;				// what the consumer should do with it
+	short len;
+	unsigned int mark;		// the producer's mark when it was put
+	unsigned char msg[SPSCSLOTSIZE - 2 * sizeof(short) - sizeof(int)];
+};
+
+struct spsc {
+	struct spscslot * slot;
+	unsigned int slots;		// a power of two
+	volatile unsigned int head;	// next slot to fill, written only by the producer
+	volatile unsigned int tail;	// next slot to take, written only by the consumer
+	volatile unsigned int dropped;	// messages lost because the ring was full
+	unsigned int mark;		// producer: copied to each slot put, eg a trace cycle
+	int wake[2];			// pipe: producer writes a byte to wake the consumer
+};
+
+int spscInit(struct spsc * r, int slots);	// slots rounded up to a power of two. 0 = ok
+int spscPut(struct spsc * r, int tag, const void * msg, int len);	// producer. 0 = ok, 1 = full or too long
+struct spscslot * spscPeek(struct spsc * r);	// consumer: oldest, or NULL if empty
+struct spscslot * spscPeekAt(struct spsc * r, int n);	// consumer: nth oldest, or NULL
+void spscDone(struct spsc * r);			// consumer: release the slot from spscPeek
+int spscWait(struct spsc * r, int tmout);	// consumer: sleep up to tmout mSec for a message
+int spscWaitOut(struct spsc * r, int tmout, int fd);	// or until fd is writable
+int spscLen(struct spsc * r);
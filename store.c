@@ -0,0 +1,133 @@
+/*
+ *  store.c
+ *  Davis
+ *
+ *  Memory-mapped ring file of LOOP records.  See store.h.
+ *
+ *  Crash safety: a record is written and msync()ed before the header is
+ *  updated, and the header is only flushed asynchronously.  On opening,
+ *  records beyond header->next whose sequence number and CRC are correct
+ *  are recovered, so power loss costs at most the record being written.
+ *
+ * $Revision$
+ */
+
+#include <stdio.h>		// for NULL
+#include <stddef.h>		// for offsetof
+#include <string.h>		// for memcpy
+#include <fcntl.h>		// for O_RDWR
+#include <unistd.h>		// for ftruncate
+#include <time.h>		// for time_t
+#include <sys/mman.h>	// for mmap
+#include <sys/stat.h>	// for fstat
+
+#include "store.h"
+#include "ccitt.h"
+
+#define RECCRCLEN offsetof(struct storerec, crc)
+
+/*************/
+/* STOREOPEN */
+/*************/
+int storeOpen(struct store * s, const char * name, int capacity) {
+	// Open or create the store file.  A file with a different layout is reinitialised.
+	struct stat st;
+	size_t size = STOREHDRSIZE + (size_t)capacity * sizeof(struct storerec);
+	struct storerec * r;
+	int fresh = 0;
+	
+	if ((s->fd = open(name, O_RDWR | O_CREAT, 0644)) < 0)
+		return -1;
+	if (fstat(s->fd, &st) < 0 || st.st_size != size) {
+		if (ftruncate(s->fd, 0) < 0 || ftruncate(s->fd, size) < 0) {
+			close(s->fd);
+			return -1;
+		}
+		fresh = 1;
+	}
+	s->hdr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, s->fd, 0);
+	if (s->hdr == MAP_FAILED) {
+		close(s->fd);
+		return -1;
+	}
+	s->recs = (unsigned char *)s->hdr + STOREHDRSIZE;
+	if (fresh || memcmp(s->hdr->magic, STOREMAGIC, 8) || s->hdr->recsize != sizeof(struct storerec) 
+		|| s->hdr->capacity != capacity) {
+		memset(s->hdr, 0, STOREHDRSIZE);
+		memcpy(s->hdr->magic, STOREMAGIC, 8);
+		s->hdr->recsize = sizeof(struct storerec);
+		s->hdr->capacity = capacity;
+		msync(s->hdr, STOREHDRSIZE, MS_SYNC);
+	}
+	// Recover records written after the header was last flushed
+	for (;;) {
+		r = (struct storerec *)(s->recs + (s->hdr->next % capacity) * sizeof(struct storerec));
+		if (r->time == 0 || r->seq != s->hdr->next || crcUpdate(0, (unsigned char *)r, RECCRCLEN) != r->crc)
+			break;
+		s->hdr->next++;
+		if (s->hdr->count < capacity) s->hdr->count++;
+	}
+	return 0;
+}
+
+/***************/
+/* STOREAPPEND */
+/***************/
+int storeAppend(struct store * s, time_t t, const unsigned char * loop) {
+	struct storerec * r;
+	long pagesize = sysconf(_SC_PAGESIZE);
+	unsigned char * start;
+	r = (struct storerec *)(s->recs + (s->hdr->next % s->hdr->capacity) * sizeof(struct storerec));
+	r->time = t;
+	r->seq = s->hdr->next;
+	memcpy(r->loop, loop, sizeof(r->loop));
+	r->pad = 0;
+	r->crc = crcUpdate(0, (unsigned char *)r, RECCRCLEN);
+	// msync needs a page aligned start
+	start = (unsigned char *)((size_t)r & ~(pagesize - 1));
+	if (msync(start, (unsigned char *)(r + 1) - start, MS_SYNC) < 0)
+		return -1;
+	s->hdr->next++;
+	if (s->hdr->count < s->hdr->capacity) s->hdr->count++;
+	msync(s->hdr, STOREHDRSIZE, MS_ASYNC);
+	return 0;
+}
+
+/**************/
+/* STORECOUNT */
+/**************/
+int storeCount(struct store * s) {
+	return s->hdr->count;
+}
+
+/************/
+/* STOREGET */
+/************/
+struct storerec * storeGet(struct store * s, int i) {
+	unsigned int seq = s->hdr->next - s->hdr->count + i;
+	return (struct storerec *)(s->recs + (seq % s->hdr->capacity) * sizeof(struct storerec));
+}
+
+/*************/
+/* STOREFIND */
+/*************/
+int storeFind(struct store * s, time_t t) {
+	// Binary search on record times.  Assumes the clock has not gone backwards.
+	int lo = 0, hi = s->hdr->count, mid;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (storeGet(s, mid)->time < t) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
+}
+
+/**************/
+/* STORECLOSE */
+/**************/
+void storeClose(struct store * s) {
+	size_t size = STOREHDRSIZE + (size_t)s->hdr->capacity * sizeof(struct storerec);
+	msync(s->hdr, size, MS_SYNC);
+	munmap(s->hdr, size);
+	close(s->fd);
+}
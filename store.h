@@ -0,0 +1,42 @@
+/*
+ *  store.h
+ *  Davis
+ *
+ *  Local time series store.  A memory-mapped file holding a ring of fixed
+ *  size records, each a validated LOOP packet with its time.  Records are
+ *  written in time order so the ring can be searched by time.
+ *
+ * $Revision$
+ */
+
+#define STOREMAGIC "DAVISTS1"
+#define STOREHDRSIZE 4096		/* header has a page to itself */
+
+struct storehdr {
+	char magic[8];
+	unsigned int recsize;
+	unsigned int capacity;	// records
+	unsigned int next;		// sequence number of the next record. Slot = seq % capacity
+	unsigned int count;		// valid records, up to capacity
+};
+
+struct storerec {
+	unsigned int time;		// Unix time
+	unsigned int seq;
+	unsigned char loop[97];	// LOOP packet less CRC
+	unsigned char pad;
+	unsigned short crc;		// over the above.  Identifies a complete record after a crash
+};
+
+struct store {
+	int fd;
+	struct storehdr * hdr;
+	unsigned char * recs;	// capacity records following the header
+};
+
+int storeOpen(struct store * s, const char * name, int capacity);	// 0 = ok
+int storeAppend(struct store * s, time_t t, const unsigned char * loop);	// 0 = ok
+int storeCount(struct store * s);
+struct storerec * storeGet(struct store * s, int i);	// i = 0 is the oldest
+int storeFind(struct store * s, time_t t);	// index of first record at or after t, or storeCount
+void storeClose(struct store * s);
@@ -0,0 +1,74 @@
+/*
+ *  trace.c
+ *  Davis
+ *
+ *  Cycle phase trace ring.  See trace.h.  Cycles are started only by the 
+ *  acquisition thread.  The publisher thread marks TR_WRITTEN against the
+ *  cycle number it was handed, which is ignored if the ring has since 
+ *  moved past that cycle.
+ *
+ * $Revision$
+ */
+
+#include <stdio.h>		// for snprintf
+#include <time.h>		// for clock_gettime
+
+#include "trace.h"
+
+#define barrier() __sync_synchronize()
+
+/*********/
+/* USNOW */
+/*********/
+long long usNow(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/**************/
+/* TRACESTART */
+/**************/
+unsigned int traceStart(struct trace * t, int station, int type) {
+	unsigned int n = ++t->count;
+	struct cycle * c;
+	int i;
+	if (n == 0) n = ++t->count;		// 0 means no cycle
+	c = &t->cycle[n % TRACECYCLES];
+	c->n = 0;			// a late mark for the cycle this replaces is ignored
+	barrier();
+	c->station = station;
+	c->type = type;
+	c->start = usNow();
+	for (i = 0; i < TR_PHASES; i++)
+		c->at[i] = -1;
+	barrier();
+	c->n = n;
+	return n;
+}
+
+/*************/
+/* TRACEMARK */
+/*************/
+void traceMark(struct trace * t, unsigned int n, int phase) {
+	struct cycle * c = &t->cycle[n % TRACECYCLES];
+	if (n == 0 || c->n != n) return;
+	c->at[phase] = usNow() - c->start;
+}
+
+/***************/
+/* TRACEFORMAT */
+/***************/
+int traceFormat(struct trace * t, int back, char * buf, int size) {
+	// "number station type start" then the phases in uSec from start
+	struct cycle * c;
+	unsigned int n = t->count - back;
+	int i, len;
+	if (back < 0 || back >= TRACECYCLES || (unsigned int)back >= t->count) return 0;
+	c = &t->cycle[n % TRACECYCLES];
+	if (c->n != n) return 0;
+	len = snprintf(buf, size, "%u %d %d %lld", n, c->station, c->type, c->start);
+	for (i = 0; i < TR_PHASES && len < size; i++)
+		len += snprintf(buf + len, size - len, " %d", c->at[i]);
+	return len < size ? len : size - 1;
+}
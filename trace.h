@@ -0,0 +1,33 @@
+/*
+ *  trace.h
+ *  Davis
+ *
+ *  Phase timestamps for each acquisition cycle, kept in a fixed ring so 
+ *  an intermittent latency spike can be examined after the event with the
+ *  "trace" command.  Recording a phase is a clock read and a store.
+ *
+ * $Revision$
+ */
+
+#define TRACECYCLES 64		/* cycles kept */
+
+// Phases of a cycle
+enum phases { TR_WAKESTART, TR_WAKEEND, TR_SENT, TR_FIRST, TR_LAST, TR_CRC, TR_WRITTEN, TR_PHASES };
+
+struct cycle {
+	volatile unsigned int n;	// cycle number, 0 while being set up
+	int station;			// controller number
+	int type;				// what the cycle did (the caller's job type)
+	long long start;		// uSec on the monotonic clock
+	int at[TR_PHASES];		// uSec after start each phase was last reached, -1 if not
+};
+
+struct trace {
+	unsigned int count;		// cycles started
+	struct cycle cycle[TRACECYCLES];
+};
+
+long long usNow(void);		// monotonic microseconds
+unsigned int traceStart(struct trace * t, int station, int type);	// new cycle. Returns its number, never 0
+void traceMark(struct trace * t, unsigned int n, int phase);	// cycle n reached phase now
+int traceFormat(struct trace * t, int back, char * buf, int size);	// back cycles before the latest. 0 if none
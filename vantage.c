@@ -0,0 +1,206 @@
+/*
+ *  vantage.c
+ *  Davis
+ *
+ *  Decoders for VantagePro console records.  See vantage.h.
+ *  Offsets are from the Vantage Serial Communication Reference Manual.
+ *
+ * $Revision$
+ */
+
+#include <stdio.h>	// for snprintf
+#include <stdlib.h>	// for abs
+
+#include "vantage.h"
+
+// Little-endian fields, safe at any alignment
+#define S8(p, o)	((short)(p)[o])
+#define S16(p, o)	((short)((p)[o] | ((p)[(o) + 1] << 8)))
+
+// LOOP schema: name, {LOOP offset, size, mult}, {LOOP2 offset, size, mult}, signed, decimals, deadband
+const struct loopfield loopfields[LF_NUM] = {
+	{"trend",	{{3, 1, 1}, {3, 1, 1}},		1, 0, 0},
+	{"bar",		{{7, 2, 1}, {7, 2, 1}},		0, 3, 5},
+	{"intemp",	{{9, 2, 1}, {9, 2, 1}},		1, 1, 5},
+	{"inhum",	{{11, 1, 1}, {11, 1, 1}},	0, 0, 1},
+	{"outtemp",	{{12, 2, 1}, {12, 2, 1}},	1, 1, 1},
+	{"wind",	{{14, 1, 1}, {14, 1, 1}},	0, 0, 1},
+	{"windavg",	{{15, 1, 10}, {18, 2, 1}},	0, 1, 10},	// 10 minute average
+	{"dir",		{{16, 2, 1}, {16, 2, 1}},	0, 0, 10},
+	{"outhum",	{{33, 1, 1}, {33, 1, 1}},	0, 0, 1},
+	{"dew",		{{-1, 0, 0}, {30, 2, 10}},	1, 1, 10},
+	{"rainrate", {{41, 2, 1}, {41, 2, 1}},	0, 2, 1},
+	{"uv",		{{43, 1, 1}, {43, 1, 1}},	0, 1, 1},
+	{"solar",	{{44, 2, 1}, {44, 2, 1}},	0, 0, 10},
+	{"dayrain",	{{50, 2, 1}, {50, 2, 1}},	0, 2, 1},
+	{"monrain",	{{52, 2, 1}, {-1, 0, 0}},	0, 2, 1},
+	{"yrrain",	{{54, 2, 1}, {-1, 0, 0}},	0, 2, 1},
+	{"alarms",	{{70, 4, 1}, {-1, 0, 0}},	0, 0, 0},
+	{"batt",	{{87, 2, 1}, {-1, 0, 0}},	0, 0, 20},	// volts = batt * 300 / 51200
+	{"sunrise",	{{91, 2, 1}, {-1, 0, 0}},	0, 0, 0},	// hhmm
+	{"sunset",	{{93, 2, 1}, {-1, 0, 0}},	0, 0, 0},
+};
+
+/*************/
+/* LOOPFIELD */
+/*************/
+int loopField(const unsigned char * p, int field, int * value) {
+	// Read one field from a LOOP or LOOP2 packet in place.
+	const struct loopfield * f = &loopfields[field];
+	const struct looploc * at = &f->at[loopType(p)];
+	const unsigned char * q;
+	int v;
+	if (at->offset < 0) return 0;
+	q = p + at->offset;
+	switch (at->size) {
+	case 1: v = f->sign ? (signed char)q[0] : q[0]; break;
+	case 2: v = f->sign ? (short)(q[0] | (q[1] << 8)) : (q[0] | (q[1] << 8)); break;
+	default: v = q[0] | (q[1] << 8) | (q[2] << 16) | (q[3] << 24);
+	}
+	*value = v * at->mult;
+	return 1;
+}
+
+/**************/
+/* LOOPDECODE */
+/**************/
+int loopDecode(const unsigned char * p, int * values) {
+	int i;
+	for (i = 0; i < LF_NUM; i++)
+		if (!loopField(p, i, &values[i])) values[i] = LOOPABSENT;
+	return loopType(p);
+}
+
+/**************/
+/* FORMATLOOP */
+/**************/
+int formatLoop(const int * values, char * buf, int len) {
+	// "name value" pairs with the decimal point placed by integer arithmetic
+	static const int pow10[] = {1, 10, 100, 1000};
+	int i, n = 0, d, v;
+	for (i = 0; i < LF_NUM && n < len; i++) {
+		v = values[i];
+		if (v == LOOPABSENT) continue;
+		d = loopfields[i].decimals;
+		if (d == 0)
+			n += snprintf(buf + n, len - n, " %s %d", loopfields[i].name, v);
+		else
+			n += snprintf(buf + n, len - n, " %s %s%d.%0*d", loopfields[i].name, v < 0 ? "-" : "",
+				abs(v) / pow10[d], d, abs(v) % pow10[d]);
+	}
+	return n;
+}
+
+/****************/
+/* DECODEHILOWS */
+/****************/
+void decodeHilows(const unsigned char * p, struct hilows * h) {
+	h->bar.lo = S16(p, 0);
+	h->bar.hi = S16(p, 2);
+	h->monthbarlo = S16(p, 4);
+	h->monthbarhi = S16(p, 6);
+	h->yearbarlo = S16(p, 8);
+	h->yearbarhi = S16(p, 10);
+	h->bar.tlo = S16(p, 12);
+	h->bar.thi = S16(p, 14);
+	
+	h->windhi = S8(p, 16);
+	h->twindhi = S16(p, 17);
+	h->monthwindhi = S8(p, 19);
+	h->yearwindhi = S8(p, 20);
+	
+	h->intemp.hi = S16(p, 21);
+	h->intemp.lo = S16(p, 23);
+	h->intemp.thi = S16(p, 25);
+	h->intemp.tlo = S16(p, 27);
+	
+	h->outtemp.lo = S16(p, 47);
+	h->outtemp.hi = S16(p, 49);
+	h->outtemp.tlo = S16(p, 51);
+	h->outtemp.thi = S16(p, 53);
+	h->monthouttemphi = S16(p, 55);
+	h->monthouttemplo = S16(p, 57);
+	h->yearouttemphi = S16(p, 59);
+	h->yearouttemplo = S16(p, 61);
+	
+	h->dewpoint.lo = S16(p, 63);
+	h->dewpoint.hi = S16(p, 65);
+	h->dewpoint.tlo = S16(p, 67);
+	h->dewpoint.thi = S16(p, 69);
+	
+	h->rainratehi = S16(p, 116);
+	h->trainratehi = S16(p, 118);
+	h->hourrainratehi = S16(p, 120);
+	h->monthrainratehi = S16(p, 122);
+	h->yearrainratehi = S16(p, 124);
+	
+	// Outside humidity is the first of each group of 8 extra humidities
+	h->outhum.lo = S8(p, 276);
+	h->outhum.hi = S8(p, 284);
+	h->outhum.tlo = S16(p, 292);
+	h->outhum.thi = S16(p, 308);
+	h->monthouthumhi = S8(p, 324);
+	h->monthouthumlo = S8(p, 332);
+	h->yearouthumhi = S8(p, 340);
+	h->yearouthumlo = S8(p, 348);
+}
+
+/****************/
+/* FORMATHILOWS */
+/****************/
+int formatHilows(const struct hilows * h, char * buf, int len) {
+	// Integers only, in console units.  Day values are lo hi tlo thi.
+	return snprintf(buf, len, "davis hilow bar %d %d %d %d %d %d %d %d "
+		"wind %d %d %d %d "
+		"in %d %d %d %d "
+		"out %d %d %d %d %d %d %d %d "
+		"hum %d %d %d %d %d %d %d %d "
+		"dew %d %d %d %d "
+		"rain %d %d %d %d %d",
+		h->bar.lo, h->bar.hi, h->bar.tlo, h->bar.thi, h->monthbarlo, h->monthbarhi, h->yearbarlo, h->yearbarhi,
+		h->windhi, h->twindhi, h->monthwindhi, h->yearwindhi,
+		h->intemp.lo, h->intemp.hi, h->intemp.tlo, h->intemp.thi,
+		h->outtemp.lo, h->outtemp.hi, h->outtemp.tlo, h->outtemp.thi, 
+		h->monthouttemplo, h->monthouttemphi, h->yearouttemplo, h->yearouttemphi,
+		h->outhum.lo, h->outhum.hi, h->outhum.tlo, h->outhum.thi,
+		h->monthouthumlo, h->monthouthumhi, h->yearouthumlo, h->yearouthumhi,
+		h->dewpoint.lo, h->dewpoint.hi, h->dewpoint.tlo, h->dewpoint.thi,
+		h->rainratehi, h->trainratehi, h->hourrainratehi, h->monthrainratehi, h->yearrainratehi);
+}
+
+/****************/
+/* DECODEEEPROM */
+/****************/
+void decodeEeprom(const unsigned char * ee, struct eeconfig * c) {
+	// Only the configuration block EE_CONFIG .. EE_CONFIG + EE_CONFIGLEN is used
+	int i;
+	c->latitude = S16(ee, 0x0B);
+	c->longitude = S16(ee, 0x0D);
+	c->elevation = S16(ee, 0x0F);
+	c->timezone = ee[0x11];
+	for (i = 0; i < 16; i++) c->stations[i] = ee[0x19 + i];
+	c->unitbits = ee[0x29];
+	c->setupbits = ee[0x2B];
+	c->rainseason = ee[0x2C];
+	c->archiveperiod = ee[0x2D];
+	c->intempcal = ee[0x32];
+	c->outtempcal = ee[0x34];
+	for (i = 0; i < 7; i++) c->tempcal[i] = ee[0x35 + i];
+	c->inhumcal = ee[0x44];
+	for (i = 0; i < 7; i++) c->humcal[i] = ee[0x46 + i];	// 0x45 is outside humidity
+	c->dircal = S16(ee, 0x4D);
+}
+
+/****************/
+/* FORMATEEPROM */
+/****************/
+int formatEeprom(const struct eeconfig * c, char * buf, int len) {
+	int i, n;
+	n = snprintf(buf, len, "davis config lat %d long %d elev %d tz %d units 0x%02x setup 0x%02x "
+		"rainseason %d archive %d cal %d %d %d dir %d stations",
+		c->latitude, c->longitude, c->elevation, c->timezone, c->unitbits, c->setupbits,
+		c->rainseason, c->archiveperiod, c->intempcal, c->outtempcal, c->inhumcal, c->dircal);
+	for (i = 0; i < 16 && n < len; i += 2)
+		n += snprintf(buf + n, len - n, " %02x%02x", c->stations[i], c->stations[i + 1]);
+	return n;
+}
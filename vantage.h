@@ -0,0 +1,89 @@
+/*
+ *  vantage.h
+ *  Davis
+ *
+ *  Layouts of the binary records returned by the VantagePro console
+ *  and decoders for them.  Values are kept in the console's own units
+ *  (tenths of a degree F, thousandths of an inch Hg, hhmm times etc).
+ *
+ * $Revision$
+ */
+
+#define HILOWSIZE 436		/* HILOWS payload without CRC */
+#define LOOPSIZE 99			/* LOOP and LOOP2 packets including CRC */
+
+// LOOP / LOOP2 fields.  Values are integers in the units of the field's
+// decimals, eg bar 29812 = 29.812 in Hg.  Fields missing from one packet
+// type have offset -1.
+enum loopfields {LF_BARTREND, LF_BAR, LF_INTEMP, LF_INHUM, LF_OUTTEMP, LF_WINDSPEED, LF_WINDAVG,
+	LF_WINDDIR, LF_OUTHUM, LF_DEWPOINT, LF_RAINRATE, LF_UV, LF_SOLAR, LF_DAYRAIN, LF_MONTHRAIN,
+	LF_YEARRAIN, LF_ALARMS, LF_BATTERY, LF_SUNRISE, LF_SUNSET, LF_NUM};
+
+struct looploc {
+	short offset;		// from start of packet ('L'), -1 if absent
+	char size;			// 1, 2 or 4 bytes, little endian
+	char mult;			// scale raw value to the field's decimals
+};
+
+struct loopfield {
+	const char * name;
+	struct looploc at[2];	// LOOP, LOOP2
+	char sign;			// value is signed
+	char decimals;
+	short deadband;		// default smallest change worth reporting. 0 = any change
+};
+
+extern const struct loopfield loopfields[LF_NUM];
+
+#define loopType(p) ((p)[4] == 1)		/* 0 = LOOP, 1 = LOOP2 */
+int loopField(const unsigned char * p, int field, int * value);	// one field straight from the buffer. 0 if absent
+int loopDecode(const unsigned char * p, int * values);	// all fields; absent ones are LOOPABSENT. Returns type
+#define LOOPABSENT (-0x7FFFFFFF)
+int formatLoop(const int * values, char * buf, int len);	// text without floating point
+
+struct hilowpair {		// a daily low and high with the time of each
+	short lo, hi;
+	short tlo, thi;		// hhmm, or -1 if none
+};
+
+struct hilows {			// Decoded HILOWS
+	struct hilowpair bar;		// thousandths in Hg
+	short monthbarlo, monthbarhi, yearbarlo, yearbarhi;
+	short windhi, twindhi;		// mph
+	short monthwindhi, yearwindhi;
+	struct hilowpair intemp;	// tenths F
+	struct hilowpair outtemp;
+	short monthouttemplo, monthouttemphi, yearouttemplo, yearouttemphi;
+	struct hilowpair outhum;	// %
+	short monthouthumlo, monthouthumhi, yearouthumlo, yearouthumhi;
+	struct hilowpair dewpoint;	// whole F
+	short rainratehi, trainratehi;	// hundredths in/hr
+	short hourrainratehi, monthrainratehi, yearrainratehi;
+};
+
+void decodeHilows(const unsigned char * p, struct hilows * h);	// p is the 436 byte payload
+int formatHilows(const struct hilows * h, char * buf, int len);	// compact text for the MCP
+
+// EEPROM.  Addresses of the configuration block read with EEBRD
+#define EESIZE 4096
+#define EE_CONFIG 0x0B		/* LATITUDE - first byte of interest */
+#define EE_CONFIGLEN 0x44	/* up to and including DIR_CAL */
+#define EE_UNITBITS 0x29	/* UNIT_BITS .. ARCHIVE_PERIOD: re-read to detect changes */
+#define EE_SIGLEN 5
+
+struct eeconfig {		// Decoded configuration settings
+	short latitude, longitude;	// tenths of a degree, negative = S, W
+	short elevation;			// feet
+	unsigned char timezone;
+	unsigned char stations[16];	// 8 x (type, repeater/channel)
+	unsigned char unitbits;		// bar 0-1, temp 2-3, elev 4, rain 5, wind 6-7
+	unsigned char setupbits;
+	unsigned char rainseason;	// month
+	unsigned char archiveperiod;	// minutes
+	signed char intempcal, outtempcal, inhumcal;	// tenths F, %
+	signed char tempcal[7], humcal[7];	// extra sensors
+	short dircal;				// degrees
+};
+
+void decodeEeprom(const unsigned char * ee, struct eeconfig * c);	// ee is indexed by EEPROM address
+int formatEeprom(const struct eeconfig * c, char * buf, int len);	// compact text for the MCP
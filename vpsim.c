@@ -0,0 +1,536 @@
+/*
+ *  vpsim.c
+ *  Davis
+ *
+ *  VantagePro console simulator on a pseudo-terminal, so davis can be run
+ *  and measured without a console.  Answers the wakeup, LOOP, LPS (LOOP2),
+ *  HILOWS, GETEE, EEBRD, TEST and DMPAFT commands with correct CRCs.
+ *  Replies can be delayed, paced at a baud rate, and have bytes dropped
+ *  or corrupted.
+ *
+ *  Usage: vpsim [-p period] [-l latency] [-b baud] [-d drops] [-n noise]
+ *               [-a pages] [-r seed] [-B secs davis [davis options]]
+ *
+ *  Without -B it prints the pty name and serves until killed.  With -B it
+ *  also plays the MCP on port 10010, runs davis against itself for secs
+ *  and reports realtime samples/s, LOOP-to-server latency percentiles and
+ *  the CPU time davis used.
+ *
+ * $Revision$
+ */
+
+#define _GNU_SOURCE		// for posix_openpt and cfmakeraw
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#include "ccitt.h"
+#include "vantage.h"
+
+#define ACK 0x06
+#define NAK 0x21
+#define ESC 0x1B
+#define PORTNO 10010
+#define OUTSIZE 16384		/* bytes waiting to go to davis */
+#define PENDING 64			/* LOOP packets in OUTSIZE whose last byte is not yet written */
+#define SEQRING 4096		/* send times kept for matching realtime messages */
+#define MAXSAMPLES 200000
+#define PAGESIZE 267
+#define RECORDSIZE 52
+
+// Options
+int period = 2000;		// -p: mSec between LOOP packets, as the console
+int latency = 0;		// -l: mSec before a reply starts
+int baud = 19200;		// -b: 0 = as fast as the pty takes it
+int drops = 0;			// -d: bytes in 10000 lost
+int noise = 0;			// -n: bytes in 10000 with a bit flipped
+int npages = 3;			// -a: DMPAFT pages
+
+// Console
+int ptyfd;
+unsigned char line[64];
+int linelen;
+int looping;			// LOOP packets still to send
+int loopType;			// LPS bitmap: 1 = LOOP, 2 = LOOP2, 3 = alternate
+long long nextLoop;		// uSec when the next is due
+unsigned int seq;		// LOOP packets sent, also in the packet to match realtime
+enum { D_NONE, D_STAMP, D_PAGES } dmp;
+unsigned char stamp[6];
+int stamplen, page;
+
+// Output to davis, paced
+unsigned char out[OUTSIZE];
+int outHead, outLen;
+long long outReady;		// uSec when the line is free to start sending
+long long byteTime;		// uSec per byte at baud
+unsigned long long outTotal;	// bytes written
+struct { unsigned long long end; unsigned int seq; } pending[PENDING];
+int npending;
+long long sentAt[SEQRING];	// uSec each LOOP packet was completely written
+
+// Bench
+int samples[MAXSAMPLES];	// uSec LOOP written to realtime received
+int nsamples;
+int mcpfd = -1;
+unsigned char mcpbuf[4096];
+int mcphave;
+
+/*********/
+/* USNOW */
+/*********/
+long long usNow(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/********/
+/* EMIT */
+/********/
+void emit(const unsigned char * p, int len) {
+// Queue bytes for davis, losing or corrupting some as -d and -n ask
+	int i, r;
+	if (outLen == 0 && outReady < usNow() + latency * 1000LL)
+		outReady = usNow() + latency * 1000LL;		// line idle: the clock starts now
+	if (outHead + outLen + len > OUTSIZE) {
+		memmove(out, out + outHead, outLen);
+		outHead = 0;
+	}
+	if (outLen + len > OUTSIZE) {
+		fprintf(stderr, "vpsim: output overflow - davis isn't reading\n");
+		return;
+	}
+	for (i = 0; i < len; i++) {
+		r = rand() % 10000;
+		if (r < drops) continue;
+		out[outHead + outLen++] = (r < drops + noise) ? p[i] ^ (1 << (rand() & 7)) : p[i];
+	}
+}
+
+/***********/
+/* EMITCRC */
+/***********/
+void emitCrc(unsigned char * p, int len) {
+// p has room for the two CRC bytes after len
+	unsigned short crc = crcUpdate(0, p, len);
+	p[len] = crc >> 8;
+	p[len + 1] = crc & 0xFF;
+	emit(p, len + 2);
+}
+
+/********/
+/* PUMP */
+/********/
+void pump(void) {
+// Write what the baud rate allows by now.  Note when a LOOP packet's last byte goes.
+	long long now = usNow();
+	int n, i;
+	if (outLen == 0 || now < outReady) return;
+	if (byteTime == 0) n = outLen;
+	else {		// emit restarts the clock if the line was idle, so this keeps the credit
+		n = (now - outReady) / byteTime + 1;
+		if (n > outLen) n = outLen;
+	}
+	if ((n = write(ptyfd, out + outHead, n)) <= 0) return;
+	outHead += n;
+	outLen -= n;
+	outTotal += n;
+	if (outLen == 0) outHead = 0;
+	outReady += n * byteTime;
+	while (npending && pending[0].end <= outTotal) {
+		sentAt[pending[0].seq % SEQRING] = now;
+		for (i = 1; i < npending; i++) pending[i - 1] = pending[i];
+		npending--;
+	}
+}
+
+/************/
+/* SENDLOOP */
+/************/
+void sendLoop(void) {
+// One LOOP or LOOP2 packet.  The sequence number takes the next-record
+// bytes (LOOP) or the unused ones at the same place (LOOP2).
+	unsigned char p[LOOPSIZE];
+	int type = (loopType == 2 || (loopType == 3 && (seq & 1))) ? 1 : 0;
+	memset(p, 0, sizeof(p));
+	memcpy(p, "LOO", 3);
+	p[3] = type ? 0 : 'P';		// bar trend on LOOP
+	p[4] = type;
+	p[5] = seq & 0xFF;
+	p[6] = (seq >> 8) & 0xFF;
+	p[7] = (29900 + seq % 100) & 0xFF;	// bar
+	p[8] = (29900 + seq % 100) >> 8;
+	p[9] = 700 & 0xFF;				// inside temp
+	p[10] = 700 >> 8;
+	p[11] = 45;						// inside humidity
+	p[12] = (550 + seq % 50) & 0xFF;	// outside temp
+	p[13] = (550 + seq % 50) >> 8;
+	p[14] = seq % 20;				// wind speed
+	p[16] = 180 & 0xFF;				// wind direction
+	p[17] = 180 >> 8;
+	p[33] = 60;						// outside humidity
+	p[95] = '\n';
+	p[96] = '\r';
+	emitCrc(p, LOOPSIZE - 2);
+	if (npending < PENDING) {
+		pending[npending].end = outTotal + outLen;
+		pending[npending++].seq = seq;
+	}
+	seq++;
+}
+
+/************/
+/* SENDPAGE */
+/************/
+void sendPage(void) {
+// Five archive records with consecutive time stamps after the one asked for
+	unsigned char p[PAGESIZE];
+	unsigned int date = stamp[0] | (stamp[1] << 8), tm = stamp[2] | (stamp[3] << 8);
+	int i;
+	memset(p, 0, sizeof(p));
+	p[0] = page;
+	if (date == 0) date = (26 << 9) | (1 << 5) | 1;	// 1 Jan 2026
+	for (i = 0; i < 5; i++) {
+		unsigned char * r = p + 1 + i * RECORDSIZE;
+		unsigned int t = tm + page * 5 + i + 1;
+		r[0] = date & 0xFF;
+		r[1] = date >> 8;
+		r[2] = t & 0xFF;
+		r[3] = t >> 8;
+	}
+	emitCrc(p, PAGESIZE - 2);
+}
+
+/**************/
+/* SENDHILOWS */
+/**************/
+void sendHilows(void) {
+// Every field davis decodes holds a value made from its offset: 1000 +
+// offset for words, offset % 100 for bytes.  So the hilow reply shows
+// at once if a field is read from the wrong place.
+	static const int words[] = {0, 2, 4, 6, 8, 10, 12, 14, 17, 21, 23, 25, 27,
+		47, 49, 51, 53, 55, 57, 59, 61, 63, 65, 67, 69, 116, 118, 120, 122, 124, 292, 308};
+	static const int bytes[] = {16, 19, 20, 276, 284, 324, 332, 340, 348};
+	unsigned char p[HILOWSIZE + 2];
+	unsigned int i;
+	memset(p, 0, sizeof(p));
+	for (i = 0; i < sizeof(words) / sizeof(words[0]); i++) {
+		p[words[i]] = (1000 + words[i]) & 0xFF;
+		p[words[i] + 1] = (1000 + words[i]) >> 8;
+	}
+	for (i = 0; i < sizeof(bytes) / sizeof(bytes[0]); i++)
+		p[bytes[i]] = bytes[i] % 100;
+	emitCrc(p, HILOWSIZE);
+}
+
+/***********/
+/* COMMAND */
+/***********/
+void command(char * cmd) {
+	unsigned char buf[EESIZE + 3];
+	unsigned int addr, n;
+	int i;
+	looping = 0;			// anything at all stops a LOOP
+	if (cmd[0] == '\0') {
+		emit((unsigned char *)"\n\r", 2);
+	} else if (strcmp(cmd, "TEST") == 0) {
+		emit((unsigned char *)"\n\rTEST\n\r", 8);
+	} else if (sscanf(cmd, "LOOP %u", &n) == 1) {
+		buf[0] = ACK;
+		emit(buf, 1);
+		looping = n;
+		loopType = 1;
+		nextLoop = usNow() + latency * 1000LL;
+	} else if (sscanf(cmd, "LPS %u %u", &addr, &n) == 2) {
+		buf[0] = ACK;
+		emit(buf, 1);
+		looping = n;
+		loopType = addr & 3 ? addr & 3 : 1;
+		nextLoop = usNow() + latency * 1000LL;
+	} else if (strcmp(cmd, "HILOWS") == 0) {
+		buf[0] = ACK;
+		emit(buf, 1);
+		sendHilows();
+	} else if (strcmp(cmd, "GETEE") == 0) {
+		buf[0] = ACK;
+		emit(buf, 1);
+		for (i = 0; i < EESIZE; i++) buf[i] = i;
+		emitCrc(buf, EESIZE);
+	} else if (sscanf(cmd, "EEBRD %x %x", &addr, &n) == 2 && addr + n <= EESIZE) {
+		buf[0] = ACK;
+		emit(buf, 1);
+		for (i = 0; i < n; i++) buf[i] = addr + i;
+		emitCrc(buf, n);
+	} else if (strcmp(cmd, "DMPAFT") == 0) {
+		buf[0] = ACK;
+		emit(buf, 1);
+		dmp = D_STAMP;
+		stamplen = 0;
+	} else {
+		emit((unsigned char *)"\n\r", 2);		// as the console does for a command it doesn't know
+	}
+}
+
+/*********/
+/* INPUT */
+/*********/
+void input(unsigned char * p, int len) {
+// Bytes from davis: command lines, or the steps of a DMPAFT
+	unsigned char buf[8];
+	for (; len > 0; p++, len--) {
+		if (dmp == D_STAMP) {
+			stamp[stamplen++] = *p;
+			if (stamplen < 6) continue;
+			buf[0] = ACK;
+			emit(buf, 1);
+			if (crcUpdate(0, stamp, 6)) {		// the console wants the stamp again
+				dmp = D_NONE;
+				continue;
+			}
+			buf[0] = npages & 0xFF;
+			buf[1] = npages >> 8;
+			buf[2] = buf[3] = 0;		// first record
+			emitCrc(buf, 4);
+			page = 0;
+			dmp = D_PAGES;
+			continue;
+		}
+		if (dmp == D_PAGES) {
+			if (*p == ESC) dmp = D_NONE;
+			else if (*p == NAK && page > 0) {
+				page--;
+				sendPage();
+				page++;
+			} else if (*p == ACK) {
+				if (page < npages) {
+					sendPage();
+					page++;
+				} else
+					dmp = D_NONE;
+			}
+			continue;
+		}
+		if (*p == '\n') {
+			line[linelen] = '\0';
+			command((char *)line);
+			linelen = 0;
+		} else if (*p != '\r' && linelen < sizeof(line) - 1)
+			line[linelen++] = *p;
+	}
+}
+
+/*************/
+/* MCPINPUT */
+/*************/
+void mcpInput(void) {
+// Messages from davis: a two-byte length then the message.  A realtime
+// message carries the LOOP packet, whose sequence number says when it was sent.
+	int n, len;
+	unsigned char * m;
+	if ((n = read(mcpfd, mcpbuf + mcphave, sizeof(mcpbuf) - mcphave)) <= 0) {
+		close(mcpfd);
+		mcpfd = -1;
+		return;
+	}
+	mcphave += n;
+	while (mcphave >= 2 && mcphave >= 2 + (len = (mcpbuf[0] << 8) | mcpbuf[1])) {
+		m = mcpbuf + 2;
+		if (len >= 15 + 7 && memcmp(m, "davis realtime", 15) == 0 && nsamples < MAXSAMPLES) {
+			unsigned int s = m[15 + 5] | (m[15 + 6] << 8);
+			unsigned int back = (seq - s) & 0xFFFF;		// how many packets ago it was sent
+			if (back > 0 && back <= SEQRING / 2 && sentAt[(seq - back) % SEQRING])
+				samples[nsamples++] = usNow() - sentAt[(seq - back) % SEQRING];
+		}
+		memmove(mcpbuf, mcpbuf + 2 + len, mcphave - 2 - len);
+		mcphave -= 2 + len;
+	}
+	if (mcphave == sizeof(mcpbuf)) mcphave = 0;		// rubbish
+}
+
+/************/
+/* MCPSEND */
+/************/
+void mcpSend(const char * msg) {
+	unsigned char buf[128];
+	int len = strlen(msg) + 1;
+	buf[0] = len >> 8;
+	buf[1] = len & 0xFF;
+	memcpy(buf + 2, msg, len);
+	write(mcpfd, buf, len + 2);
+}
+
+/***********/
+/* COMPARE */
+/***********/
+int compare(const void * a, const void * b) {
+	return *(const int *)a - *(const int *)b;
+}
+
+/**********/
+/* REPORT */
+/**********/
+void report(double secs, struct rusage * ru) {
+	double cpu = ru->ru_utime.tv_sec + ru->ru_utime.tv_usec / 1e6 + ru->ru_stime.tv_sec + ru->ru_stime.tv_usec / 1e6;
+	printf("%d packets sent, %d realtime received in %.1f sec: %.2f samples/s\n", seq, nsamples, secs, nsamples / secs);
+	if (nsamples) {
+		qsort(samples, nsamples, sizeof(int), compare);
+		printf("latency mSec p50 %.2f p90 %.2f p99 %.2f max %.2f\n", samples[nsamples / 2] / 1000.0,
+			samples[nsamples * 90 / 100] / 1000.0, samples[nsamples * 99 / 100] / 1000.0, samples[nsamples - 1] / 1000.0);
+	}
+	printf("davis CPU user %.3f sys %.3f sec (%.2f%%), %.1f uSec per sample\n",
+		ru->ru_utime.tv_sec + ru->ru_utime.tv_usec / 1e6, ru->ru_stime.tv_sec + ru->ru_stime.tv_usec / 1e6,
+		cpu * 100 / secs, nsamples ? cpu * 1e6 / nsamples : 0.0);
+}
+
+/*********/
+/* USAGE */
+/*********/
+void usage(void) {
+	printf("Usage: vpsim [-p period] [-l latency] [-b baud] [-d drops] [-n noise] [-a pages] [-r seed] [-B secs davis [options]]\n");
+	printf("-p: mSec between LOOP packets (default 2000, 0 = back to back)  -l: mSec before each reply\n");
+	printf("-b: baud rate to pace replies at, 0 for none (default 19200)  -a: DMPAFT pages (default 3)\n");
+	printf("-d, -n: bytes in 10000 dropped, or with a bit flipped  -r: random seed\n");
+	printf("-B: listen as the MCP, run davis options ptyname 1 for secs and report\n");
+}
+
+/********/
+/* MAIN */
+/********/
+int main(int argc, char *argv[]) {
+	struct termios t;
+	struct pollfd fds[3];
+	struct sockaddr_in sa;
+	struct rusage ru;
+	unsigned char buf[1024];
+	char * name;
+	char ** args;
+	int option, bench = 0, listenfd = -1, nfds, n, i, status, one = 1;
+	long long now, wait, end = 0;
+	pid_t pid = 0;
+
+	while ((option = getopt(argc, argv, "+p:l:b:d:n:a:r:B:")) != -1) {
+		switch (option) {
+		case 'p': period = atoi(optarg); break;
+		case 'l': latency = atoi(optarg); break;
+		case 'b': baud = atoi(optarg); break;
+		case 'd': drops = atoi(optarg); break;
+		case 'n': noise = atoi(optarg); break;
+		case 'a': npages = atoi(optarg); break;
+		case 'r': srand(atoi(optarg)); break;
+		case 'B': bench = atoi(optarg); break;
+		default: usage(); exit(1);
+		}
+	}
+	if (bench && optind >= argc) {
+		usage();
+		exit(1);
+	}
+	byteTime = baud ? 10000000LL / baud : 0;		// start, 8 data and stop bit
+
+	if ((ptyfd = posix_openpt(O_RDWR | O_NOCTTY)) < 0 || grantpt(ptyfd) < 0 || unlockpt(ptyfd) < 0) {
+		perror("vpsim: pty");
+		exit(1);
+	}
+	tcgetattr(ptyfd, &t);
+	cfmakeraw(&t);
+	tcsetattr(ptyfd, TCSANOW, &t);
+	name = ptsname(ptyfd);
+	n = open(name, O_RDWR | O_NOCTTY);	// keep the slave open so davis reopening it doesn't hang us up
+	if (n >= 0) {
+		tcgetattr(n, &t);
+		cfmakeraw(&t);
+		tcsetattr(n, TCSANOW, &t);
+	}
+	fcntl(ptyfd, F_SETFL, O_NONBLOCK);
+
+	if (bench) {
+		signal(SIGPIPE, SIG_IGN);
+		listenfd = socket(AF_INET, SOCK_STREAM, 0);
+		setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		memset(&sa, 0, sizeof(sa));
+		sa.sin_family = AF_INET;
+		sa.sin_port = htons(PORTNO);
+		sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		if (bind(listenfd, (struct sockaddr *)&sa, sizeof(sa)) < 0 || listen(listenfd, 1) < 0) {
+			perror("vpsim: MCP port");
+			exit(1);
+		}
+		args = calloc(argc - optind + 3, sizeof(char *));
+		for (i = 0; optind + i < argc; i++) args[i] = argv[optind + i];
+		args[i++] = name;
+		args[i] = "1";
+		if ((pid = fork()) == 0) {
+			close(listenfd);
+			close(ptyfd);
+			execv(args[0], args);
+			perror("vpsim: exec");
+			_exit(1);
+		}
+		end = usNow() + bench * 1000000LL;
+	} else {
+		printf("%s\n", name);
+		fflush(stdout);
+	}
+
+	for (;;) {
+		now = usNow();
+		if (bench && now >= end) break;
+		if (looping && now >= nextLoop && outLen < LOOPSIZE) {	// don't build up a backlog
+			sendLoop();
+			looping--;
+			nextLoop = (period ? nextLoop : now) + period * 1000LL;
+			if (nextLoop < now) nextLoop = now;
+		}
+		pump();
+		wait = 1000000;
+		if (looping && nextLoop - now < wait) wait = nextLoop - now;
+		if (outLen && outReady - now < wait) wait = outReady > now ? outReady - now : 0;
+		if (bench && end - now < wait) wait = end - now;
+		if (wait < 0) wait = 0;
+		nfds = 0;
+		fds[nfds].fd = ptyfd;
+		fds[nfds++].events = POLLIN;
+		if (listenfd >= 0 && mcpfd < 0) {
+			fds[nfds].fd = listenfd;
+			fds[nfds++].events = POLLIN;
+		}
+		if (mcpfd >= 0) {
+			fds[nfds].fd = mcpfd;
+			fds[nfds++].events = POLLIN;
+		}
+		if (poll(fds, nfds, (wait + 999) / 1000) <= 0) continue;
+		for (i = 0; i < nfds; i++) {
+			if (!(fds[i].revents & (POLLIN | POLLHUP))) continue;
+			if (fds[i].fd == ptyfd) {
+				if ((n = read(ptyfd, buf, sizeof(buf))) > 0) input(buf, n);
+				else if (!bench) usleep(100000);		// nobody has the slave open
+			} else if (fds[i].fd == listenfd)
+				mcpfd = accept(listenfd, NULL, NULL);
+			else
+				mcpInput();
+		}
+	}
+
+	// Bench finished: ask davis to stop, then account for it
+	if (mcpfd >= 0) mcpSend("exit");
+	for (i = 0; i < 50 && waitpid(pid, &status, WNOHANG) == 0; i++)
+		usleep(100000);
+	if (i == 50) {
+		kill(pid, SIGKILL);
+		waitpid(pid, &status, 0);
+	}
+	getrusage(RUSAGE_CHILDREN, &ru);
+	report(bench, &ru);
+	return 0;
+}